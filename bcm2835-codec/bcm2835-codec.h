@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Userspace interface of the BCM2835 codec driver: its private controls and
+ * events.
+ *
+ * Copyright 2018 Raspberry Pi (Trading) Ltd.
+ */
+
+#ifndef __BCM2835_CODEC_H__
+#define __BCM2835_CODEC_H__
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+#include <linux/v4l2-controls.h>
+
+/*
+ * Driver private controls, allocated from a block of 16 IDs reserved for this
+ * driver the way v4l2-controls.h reserves V4L2_CID_USER_*_BASE ranges.
+ */
+#ifndef V4L2_CID_USER_BCM2835_CODEC_BASE
+#define V4L2_CID_USER_BCM2835_CODEC_BASE	(V4L2_CID_USER_BASE + 0x1300)
+#endif
+
+/*
+ * Scheduling priority. Each device_run submits at most this many OUTPUT
+ * buffers, giving a weighted round robin between contexts.
+ */
+#define V4L2_CID_USER_BCM2835_CODEC_PRIORITY \
+				(V4L2_CID_USER_BCM2835_CODEC_BASE + 0)
+/* Encoder rate control model: 0 JVT (the default), 1 VOWIFI, 2 CBR */
+#define V4L2_CID_USER_BCM2835_CODEC_RC_MODEL \
+				(V4L2_CID_USER_BCM2835_CODEC_BASE + 1)
+/*
+ * Encoder motion vectors. When enabled the CAPTURE format gains a second
+ * plane holding one (s8 x, s8 y, u16 SAD) entry per macroblock for the frame
+ * in the first plane. Not available with V4L2_MEMORY_DMABUF CAPTURE buffers.
+ */
+#define V4L2_CID_USER_BCM2835_CODEC_INLINE_VECTORS \
+				(V4L2_CID_USER_BCM2835_CODEC_BASE + 2)
+/*
+ * Second ISP output. When the width and height are non-zero the CAPTURE
+ * format gains a second plane holding the same frame scaled and converted
+ * to this size and format, produced in the same pass through the ISP.
+ */
+#define V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_WIDTH \
+				(V4L2_CID_USER_BCM2835_CODEC_BASE + 3)
+#define V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_HEIGHT \
+				(V4L2_CID_USER_BCM2835_CODEC_BASE + 4)
+#define V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_FOURCC \
+				(V4L2_CID_USER_BCM2835_CODEC_BASE + 5)
+
+/*
+ * Slice mode end of frame. With V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB each
+ * slice is returned in its own CAPTURE buffer. This event is queued as the
+ * buffer holding the last slice of a frame is returned, so a client that sees
+ * no event for a buffer it has dequeued knows more slices of that frame
+ * follow. Its payload, in struct v4l2_event u.data, is a
+ * struct bcm2835_codec_frame_end.
+ */
+#define V4L2_EVENT_BCM2835_CODEC_FRAME_END	(V4L2_EVENT_PRIVATE_START + 1)
+
+struct bcm2835_codec_frame_end {
+	__u32 index;		/* CAPTURE buffer index */
+	__u32 reserved;
+	__u64 timestamp;	/* its timestamp, in ns */
+};
+
+#endif /* __BCM2835_CODEC_H__ */
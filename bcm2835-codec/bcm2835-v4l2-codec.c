@@ -28,6 +28,10 @@
 #include <linux/slab.h>
 #include <linux/platform_device.h>
 #include <linux/syscalls.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
 #include <media/v4l2-mem2mem.h>
 #include <media/v4l2-device.h>
@@ -41,6 +45,8 @@
 #include "../vchiq-mmal/mmal-parameters.h"
 #include "../vchiq-mmal/mmal-vchiq.h"
 
+#include "bcm2835-codec.h"
+
 /*
  * Default /dev/videoN node numbers for decode and encode.
  * Deliberately avoid the very low numbers as these are often taken by webcams
@@ -71,6 +77,42 @@ static unsigned int debug;
 module_param(debug, uint, 0644);
 MODULE_PARM_DESC(debug, "activates debug info (0-3)");
 
+/*
+ * Idle MMAL components kept per device so that short lived sessions don't
+ * pay for creating and destroying a component on the VPU each time.
+ */
+static unsigned int component_pool_size = 2;
+module_param(component_pool_size, uint, 0644);
+MODULE_PARM_DESC(component_pool_size, "idle components cached per device");
+
+static unsigned int component_pool_timeout_ms = 10000;
+module_param(component_pool_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(component_pool_timeout_ms,
+		 "time before an idle cached component is destroyed");
+
+/*
+ * All MMAL traffic on one instance is serialised on a single VCHI service.
+ * When non-zero, contexts are spread over additional MMAL instances with at
+ * most this many contexts each, so independent streams don't contend.
+ */
+static unsigned int contexts_per_instance;
+module_param(contexts_per_instance, uint, 0444);
+MODULE_PARM_DESC(contexts_per_instance,
+		 "contexts per MMAL connection (0 = one connection per device)");
+
+/*
+ * Limit on OUTPUT queue buffers each context may have with the VPU. CAPTURE
+ * buffers are never held back so the VPU always has somewhere to write.
+ */
+static unsigned int max_inflight;
+module_param(max_inflight, uint, 0644);
+MODULE_PARM_DESC(max_inflight,
+		 "max input buffers per context at the VPU (0 = unlimited)");
+
+#define PRIORITY_MIN		1
+#define PRIORITY_MAX		16
+#define PRIORITY_DEFAULT	4
+
 enum bcm2835_codec_role {
 	DECODE,
 	ENCODE,
@@ -93,7 +135,23 @@ static const char * const components[] = {
 #define MIN_H		32
 #define MAX_W		1920
 #define MAX_H		1920
+#define ISP_MAX_W	16384
+#define ISP_MAX_H	16384
 #define BPL_ALIGN	32
+
+/*
+ * Maximum resolution per role. The codec block is limited to level 4.x
+ * sizes, but the ISP isn't, so allow it the same range as the standalone
+ * ISP driver. MMAL has no parameter that reports these limits.
+ */
+static const struct {
+	unsigned int max_w;
+	unsigned int max_h;
+} role_limits[] = {
+	[DECODE] = { MAX_W, MAX_H },
+	[ENCODE] = { MAX_W, MAX_H },
+	[ISP] = { ISP_MAX_W, ISP_MAX_H },
+};
 #define DEFAULT_WIDTH	640
 #define DEFAULT_HEIGHT	480
 /*
@@ -106,6 +164,16 @@ static const char * const components[] = {
  */
 #define DEF_COMP_BUF_SIZE_GREATER_720P	(768 << 10)
 #define DEF_COMP_BUF_SIZE_720P_OR_LESS	(512 << 10)
+/*
+ * For H264 encode the buffer is instead sized from the rate control settings
+ * (see get_enc_comp_sizeimage), within these bounds. The decoder has no such
+ * settings to go on, so uses the defaults above unless the client asks for
+ * larger buffers, up to COMP_BUF_SIZE_MAX.
+ */
+#define COMP_BUF_SIZE_MIN		(64 << 10)
+#define COMP_BUF_SIZE_MAX		(4 << 20)
+/* Assumed size of an I-frame relative to a P-frame */
+#define I_FRAME_SIZE_RATIO		8
 
 /* Flags that indicate a format can be used for capture/output */
 #define MEM2MEM_CAPTURE		BIT(0)
@@ -113,6 +181,9 @@ static const char * const components[] = {
 
 #define MEM2MEM_NAME		"bcm2835-codec"
 
+/* Buffers passed to the VPU per vchiq_mmal_submit_buffers() in device_run */
+#define RUN_BATCH		8
+
 struct bcm2835_codec_fmt {
 	u32	fourcc;
 	int	depth;
@@ -385,6 +456,25 @@ struct bcm2835_codec_fmt_list {
 struct m2m_mmal_buffer {
 	struct v4l2_m2m_buffer	m2m;
 	struct mmal_buffer	mmal;
+	/* Plane 1 of a CAPTURE buffer when the second ISP output is in use */
+	struct mmal_buffer	mmal_out1;
+	/* MMAL buffers still with the VPU before the vb2 buffer is done */
+	atomic_t		parts;
+	bool			failed;
+};
+
+/* Additional MMAL instance shared by up to contexts_per_instance contexts */
+struct bcm2835_codec_shard {
+	struct list_head	list;
+	struct vchiq_mmal_instance	*instance;
+	unsigned int		users;
+};
+
+/* Idle component held in the device's component pool */
+struct bcm2835_codec_pool_entry {
+	struct list_head	list;
+	struct vchiq_mmal_component	*component;
+	unsigned long		idle_since;	/* jiffies */
 };
 
 /* Per-queue, driver-specific private data */
@@ -419,6 +509,8 @@ struct bcm2835_codec_dev {
 	/* mutex for the v4l2 device */
 	struct mutex		dev_mutex;
 	atomic_t		num_inst;
+	atomic_t		ctx_id;
+	struct dentry		*debugfs_dir;
 
 	/* allocated mmal instance and components */
 	enum bcm2835_codec_role	role;
@@ -426,6 +518,17 @@ struct bcm2835_codec_dev {
 	struct bcm2835_codec_fmt_list	supported_fmts[2];
 
 	struct vchiq_mmal_instance	*instance;
+	/* contexts using instance when sharding */
+	unsigned int		instance_users;
+	/* additional MMAL instances, protected by dev_mutex */
+	struct list_head	shards;
+
+	/* idle, disabled components ready to be handed to a context */
+	struct list_head	comp_pool;
+	unsigned int		comp_pool_count;
+	/* protects comp_pool and comp_pool_count */
+	struct mutex		comp_pool_lock;
+	struct delayed_work	comp_pool_evict;
 
 	struct v4l2_m2m_dev	*m2m_dev;
 };
@@ -436,6 +539,10 @@ struct bcm2835_codec_ctx {
 
 	struct v4l2_ctrl_handler hdl;
 
+	/* MMAL instance used for this context, and its shard if not dev's */
+	struct vchiq_mmal_instance	*instance;
+	struct bcm2835_codec_shard	*shard;
+
 	struct vchiq_mmal_component  *component;
 	bool component_enabled;
 
@@ -449,10 +556,45 @@ struct bcm2835_codec_ctx {
 	s32  bitrate;
 	unsigned int	framerate_num;
 	unsigned int	framerate_denom;
+	/* encoder settings that size the compressed buffers */
+	u32 gop_size;
+	enum v4l2_mpeg_video_h264_level level;
+	enum v4l2_mpeg_video_h264_profile profile;
+	/* encoded buffers returned without FRAME_END set */
+	unsigned int num_fragments;
+	/* V4L2_CID_MPEG_VIDEO_MULTI_SLICE_* settings */
+	enum v4l2_mpeg_video_multi_slice_mode slice_mode;
+	u32 slice_max_mb;
+	/* quantiser bounds, clustered so MIN_QP is checked against MAX_QP */
+	struct v4l2_ctrl *min_qp;
+	struct v4l2_ctrl *max_qp;
+	/*
+	 * Rate control tuning sent to the component, one bit per control. Any
+	 * set keeps the component out of the pool.
+	 */
+	u32 enc_params_sent;
+	/* motion vectors are returned in a second CAPTURE plane */
+	bool inline_vectors;
+	/* encoded frame waiting for its motion vectors */
+	struct vb2_v4l2_buffer *vectors_frame;
+	/* format of the second ISP output, disabled if no size is set */
+	struct bcm2835_codec_q_data out1;
+	/* CAPTURE format changed by the VPU, to be applied at STREAMON */
+	bool source_changed;
 
 	bool aborting;
 	int num_ip_buffers;
 	int num_op_buffers;
+
+	/* scheduling and accounting */
+	unsigned int priority;
+	/* protects the fields below */
+	spinlock_t sched_lock;
+	unsigned int src_inflight;
+	u64 stream_start_ns;
+	u64 busy_since_ns;
+	u64 busy_ns;
+	struct dentry *debugfs_file;
 	struct completion frame_cmplt;
 };
 
@@ -569,6 +711,49 @@ static struct vchiq_mmal_port *get_port_data(struct bcm2835_codec_ctx *ctx,
  * mem2mem callbacks
  */
 
+/* number of OUTPUT buffers the context may still hand to the VPU */
+static unsigned int src_budget(struct bcm2835_codec_ctx *ctx)
+{
+	unsigned int budget = ctx->priority;
+	unsigned long flags;
+
+	if (max_inflight) {
+		spin_lock_irqsave(&ctx->sched_lock, flags);
+		if (ctx->src_inflight >= max_inflight)
+			budget = 0;
+		else
+			budget = min(budget, max_inflight - ctx->src_inflight);
+		spin_unlock_irqrestore(&ctx->sched_lock, flags);
+	}
+
+	return budget;
+}
+
+static void src_submitted(struct bcm2835_codec_ctx *ctx, unsigned int num)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->sched_lock, flags);
+	if (!ctx->src_inflight && num)
+		ctx->busy_since_ns = ktime_get_ns();
+	ctx->src_inflight += num;
+	spin_unlock_irqrestore(&ctx->sched_lock, flags);
+}
+
+static void src_returned(struct bcm2835_codec_ctx *ctx)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->sched_lock, flags);
+	if (ctx->src_inflight && !--ctx->src_inflight)
+		ctx->busy_ns += ktime_get_ns() - ctx->busy_since_ns;
+	spin_unlock_irqrestore(&ctx->sched_lock, flags);
+
+	/* we may have been holding the context back */
+	if (max_inflight)
+		v4l2_m2m_try_schedule(ctx->fh.m2m_ctx);
+}
+
 /*
  * job_ready() - check whether an instance is ready to be scheduled to run
  */
@@ -576,11 +761,13 @@ static int job_ready(void *priv)
 {
 	struct bcm2835_codec_ctx *ctx = priv;
 
-	if (!v4l2_m2m_num_src_bufs_ready(ctx->fh.m2m_ctx) &&
-	    !v4l2_m2m_num_dst_bufs_ready(ctx->fh.m2m_ctx))
-		return 0;
+	if (v4l2_m2m_num_dst_bufs_ready(ctx->fh.m2m_ctx))
+		return 1;
 
-	return 1;
+	if (v4l2_m2m_num_src_bufs_ready(ctx->fh.m2m_ctx) && src_budget(ctx))
+		return 1;
+
+	return 0;
 }
 
 static void job_abort(void *priv)
@@ -592,19 +779,112 @@ static void job_abort(void *priv)
 	ctx->aborting = 1;
 }
 
-static inline unsigned int get_sizeimage(int bpl, int width, int height,
+/* H264 MaxCPB in units of 1000 bits, indexed by v4l2_mpeg_video_h264_level */
+static const unsigned int h264_max_cpb[] = {
+	175, 350, 500, 1000, 2000, 2000, 4000, 4000,
+	10000, 14000, 20000, 25000, 62500, 62500, 135000, 240000,
+};
+
+/*
+ * Largest H264 frame we expect from the encoder. The average frame size
+ * follows from bitrate and framerate, and is scaled up to an I-frame based
+ * on the I-frame period, with 2x headroom for rate control overshoot.
+ * The HRD model doesn't allow a frame larger than the level's CPB, and it
+ * should never be larger than the raw frame.
+ */
+static unsigned int get_enc_comp_sizeimage(struct bcm2835_codec_ctx *ctx,
+					   int width, int height)
+{
+	u32 period = ctx->gop_size;
+	u64 frame, limit;
+
+	frame = div_u64((u64)ctx->bitrate * ctx->framerate_denom,
+			8 * ctx->framerate_num);
+	if (!period)
+		frame *= I_FRAME_SIZE_RATIO;
+	else
+		frame = div_u64(frame * I_FRAME_SIZE_RATIO * period,
+				I_FRAME_SIZE_RATIO + period - 1);
+	frame *= 2;
+
+	if (ctx->level < ARRAY_SIZE(h264_max_cpb)) {
+		limit = (u64)h264_max_cpb[ctx->level] * 1000 / 8;
+		if (ctx->profile == V4L2_MPEG_VIDEO_H264_PROFILE_HIGH)
+			limit = limit * 5 / 4;
+		frame = min(frame, limit);
+	}
+	if (width && height)
+		frame = min_t(u64, frame, width * height * 3 / 2);
+
+	return clamp_t(u64, frame, COMP_BUF_SIZE_MIN, COMP_BUF_SIZE_MAX);
+}
+
+static inline unsigned int get_sizeimage(struct bcm2835_codec_ctx *ctx,
+					 int bpl, int width, int height,
 					 struct bcm2835_codec_fmt *fmt)
 {
 	if (fmt->flags & V4L2_FMT_FLAG_COMPRESSED) {
+		if (ctx->dev->role == ENCODE &&
+		    fmt->mmal_fmt == MMAL_ENCODING_H264)
+			return get_enc_comp_sizeimage(ctx, width, height);
 		if (width * height > 1280 * 720)
 			return DEF_COMP_BUF_SIZE_GREATER_720P;
 		else
 			return DEF_COMP_BUF_SIZE_720P_OR_LESS;
 	} else {
-		return (bpl * height * fmt->size_multiplier_x2) >> 1;
+		return ((u32)bpl * height * fmt->size_multiplier_x2) >> 1;
 	}
 }
 
+static bool has_out1(struct bcm2835_codec_ctx *ctx)
+{
+	return ctx->dev->role == ISP && ctx->out1.crop_width &&
+	       ctx->out1.crop_height;
+}
+
+/* One entry per macroblock, plus the extra column the VPU adds per row */
+static unsigned int get_vectors_size(struct bcm2835_codec_ctx *ctx)
+{
+	struct bcm2835_codec_q_data *q_data = &ctx->q_data[V4L2_M2M_SRC];
+
+	return (DIV_ROUND_UP(q_data->crop_width, 16) + 1) *
+	       DIV_ROUND_UP(q_data->height, 16) * 4;
+}
+
+/* Size of the second CAPTURE plane, or 0 if the format only has one */
+static unsigned int get_plane1_size(struct bcm2835_codec_ctx *ctx, u32 type)
+{
+	if (V4L2_TYPE_IS_OUTPUT(type))
+		return 0;
+	if (ctx->dev->role == ENCODE && ctx->inline_vectors)
+		return get_vectors_size(ctx);
+	if (has_out1(ctx))
+		return ctx->out1.sizeimage;
+	return 0;
+}
+
+/*
+ * Resize the encoder's compressed buffers after a rate control change, if
+ * they haven't been allocated yet.
+ */
+static void update_enc_comp_sizeimage(struct bcm2835_codec_ctx *ctx)
+{
+	struct bcm2835_codec_q_data *q_data = &ctx->q_data[V4L2_M2M_DST];
+	struct vb2_queue *vq;
+
+	if (ctx->dev->role != ENCODE || !ctx->fh.m2m_ctx)
+		return;
+
+	vq = v4l2_m2m_get_vq(ctx->fh.m2m_ctx,
+			     V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	if (vb2_is_busy(vq))
+		return;
+
+	q_data->sizeimage = get_sizeimage(ctx, q_data->bytesperline,
+					  q_data->crop_width, q_data->height,
+					  q_data->fmt);
+}
+
 static inline unsigned int get_bytesperline(int width,
 					    struct bcm2835_codec_fmt *fmt)
 {
@@ -649,6 +929,24 @@ static void setup_mmal_port_format(struct bcm2835_codec_ctx *ctx,
 	port->current_buffer.size = q_data->sizeimage;
 };
 
+/*
+ * The VPU reports the buffer size it needs for its native layout in
+ * minimum_buffer once the format is set. Grow the buffers to match so it can
+ * DMA directly rather than the firmware repacking the image.
+ */
+static void fit_min_buffer(struct bcm2835_codec_ctx *ctx,
+			   struct bcm2835_codec_q_data *q_data,
+			   struct vchiq_mmal_port *port)
+{
+	if (q_data->sizeimage >= port->minimum_buffer.size)
+		return;
+
+	v4l2_dbg(1, debug, &ctx->dev->v4l2_dev, "%s: Buffer size %u < min buf size %u - using MMAL size\n",
+		 __func__, q_data->sizeimage, port->minimum_buffer.size);
+	q_data->sizeimage = port->minimum_buffer.size;
+	port->current_buffer.size = q_data->sizeimage;
+}
+
 static void ip_buffer_cb(struct vchiq_mmal_instance *instance,
 			 struct vchiq_mmal_port *port, int status,
 			 struct mmal_buffer *mmal_buf)
@@ -671,6 +969,8 @@ static void ip_buffer_cb(struct vchiq_mmal_instance *instance,
 		return;
 	}
 
+	src_returned(ctx);
+
 	if (status) {
 		/* error in transfer */
 		if (buf)
@@ -711,6 +1011,20 @@ static void queue_res_chg_event(struct bcm2835_codec_ctx *ctx)
 	v4l2_event_queue_fh(&ctx->fh, &ev_src_ch);
 }
 
+static void send_frame_end_event(struct bcm2835_codec_ctx *ctx,
+				 struct vb2_v4l2_buffer *vb2)
+{
+	struct v4l2_event ev = {
+		.type = V4L2_EVENT_BCM2835_CODEC_FRAME_END,
+	};
+	struct bcm2835_codec_frame_end *frame_end = (void *)ev.u.data;
+
+	frame_end->index = vb2->vb2_buf.index;
+	frame_end->timestamp = vb2->vb2_buf.timestamp;
+
+	v4l2_event_queue_fh(&ctx->fh, &ev);
+}
+
 static void send_eos_event(struct bcm2835_codec_ctx *ctx)
 {
 	static const struct v4l2_event ev = {
@@ -775,13 +1089,92 @@ static void handle_fmt_changed(struct bcm2835_codec_ctx *ctx,
 						q_data->fmt);
 
 	q_data->height = format->es.video.height;
+	/*
+	 * Existing CAPTURE buffers at least this big keep their VPU imports
+	 * over the STREAMOFF/STREAMON that userspace does in response.
+	 */
 	q_data->sizeimage = format->buffer_size_min;
 	if (format->es.video.color_space)
 		color_mmal2v4l(ctx, format->es.video.color_space);
 
+	ctx->source_changed = true;
 	queue_res_chg_event(ctx);
 }
 
+/*
+ * Return the held encoded frame with the motion vectors from @vectors in its
+ * second plane, or with that plane empty if @vectors is NULL.
+ */
+static void complete_vectors_frame(struct bcm2835_codec_ctx *ctx,
+				   struct mmal_buffer *vectors)
+{
+	struct vb2_v4l2_buffer *vb2 = xchg(&ctx->vectors_frame, NULL);
+	unsigned long len = 0;
+	void *dst;
+
+	if (!vb2)
+		return;
+
+	if (vectors) {
+		dst = vb2_plane_vaddr(&vb2->vb2_buf, 1);
+		if (dst && vectors->buffer) {
+			len = min(vectors->length,
+				  vb2_plane_size(&vb2->vb2_buf, 1));
+			memcpy(dst, vectors->buffer, len);
+		}
+	}
+	vb2_set_plane_payload(&vb2->vb2_buf, 1, len);
+
+	vb2_buffer_done(&vb2->vb2_buf, VB2_BUF_STATE_DONE);
+	ctx->num_op_buffers++;
+}
+
+/*
+ * Return a CAPTURE buffer once every MMAL buffer making it up is back from
+ * the VPU. That is both outputs when the second ISP output is in use.
+ */
+static void op_buf_done(struct m2m_mmal_buffer *buf,
+			enum vb2_buffer_state state)
+{
+	if (state == VB2_BUF_STATE_ERROR)
+		buf->failed = true;
+	if (!atomic_dec_and_test(&buf->parts))
+		return;
+
+	vb2_buffer_done(&buf->m2m.vb.vb2_buf,
+			buf->failed ? VB2_BUF_STATE_ERROR : state);
+}
+
+static void op1_buffer_cb(struct vchiq_mmal_instance *instance,
+			  struct vchiq_mmal_port *port, int status,
+			  struct mmal_buffer *mmal_buf)
+{
+	struct bcm2835_codec_ctx *ctx = port->cb_ctx;
+	struct m2m_mmal_buffer *buf;
+
+	v4l2_dbg(2, debug, &ctx->dev->v4l2_dev,
+		 "%s: status:%d, buf:%p, length:%lu, flags %u\n",
+		 __func__, status, mmal_buf, mmal_buf->length,
+		 mmal_buf->mmal_flags);
+
+	/* Format changes are handled on the main output */
+	if (mmal_buf->cmd)
+		return;
+
+	buf = container_of(mmal_buf, struct m2m_mmal_buffer, mmal_out1);
+	if (status || (!mmal_buf->length &&
+		       !(mmal_buf->mmal_flags & MMAL_BUFFER_HEADER_FLAG_EOS))) {
+		op_buf_done(buf, VB2_BUF_STATE_ERROR);
+	} else {
+		vb2_set_plane_payload(&buf->m2m.vb.vb2_buf, 1,
+				      mmal_buf->length);
+		op_buf_done(buf, VB2_BUF_STATE_DONE);
+	}
+
+	if (!port->enabled)
+		complete(&ctx->frame_cmplt);
+}
+
 static void op_buffer_cb(struct vchiq_mmal_instance *instance,
 			 struct vchiq_mmal_port *port, int status,
 			 struct mmal_buffer *mmal_buf)
@@ -802,7 +1195,7 @@ static void op_buffer_cb(struct vchiq_mmal_instance *instance,
 		/* error in transfer */
 		if (vb2) {
 			/* there was a buffer with the error so return it */
-			vb2_buffer_done(&vb2->vb2_buf, VB2_BUF_STATE_ERROR);
+			op_buf_done(buf, VB2_BUF_STATE_ERROR);
 		}
 		return;
 	}
@@ -831,14 +1224,33 @@ static void op_buffer_cb(struct vchiq_mmal_instance *instance,
 		v4l2_dbg(2, debug, &ctx->dev->v4l2_dev, "%s: Empty buffer - flags %04x",
 			 __func__, mmal_buf->mmal_flags);
 		if (!mmal_buf->mmal_flags & MMAL_BUFFER_HEADER_FLAG_EOS) {
-			vb2_buffer_done(&vb2->vb2_buf, VB2_BUF_STATE_ERROR);
+			op_buf_done(buf, VB2_BUF_STATE_ERROR);
 			if (!port->enabled)
 				complete(&ctx->frame_cmplt);
 			return;
 		}
 	}
+	if (mmal_buf->mmal_flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) {
+		/*
+		 * Motion vectors for the held frame. This buffer goes straight
+		 * back to the VPU, so userspace only sees encoded frames.
+		 */
+		complete_vectors_frame(ctx, mmal_buf);
+		mmal_buf->mmal_flags = 0;
+		if (port->enabled &&
+		    !vchiq_mmal_submit_buffer(ctx->instance, port, mmal_buf))
+			return;
+
+		vb2_set_plane_payload(&vb2->vb2_buf, 0, 0);
+		vb2_buffer_done(&vb2->vb2_buf, VB2_BUF_STATE_DONE);
+		if (!port->enabled)
+			complete(&ctx->frame_cmplt);
+		return;
+	}
+
 	if (mmal_buf->mmal_flags & MMAL_BUFFER_HEADER_FLAG_EOS) {
 		/* EOS packet from the VPU */
+		complete_vectors_frame(ctx, NULL);
 		send_eos_event(ctx);
 		vb2->flags |= V4L2_BUF_FLAG_LAST;
 	}
@@ -849,8 +1261,26 @@ static void op_buffer_cb(struct vchiq_mmal_instance *instance,
 	vb2_set_plane_payload(&vb2->vb2_buf, 0, mmal_buf->length);
 	if (mmal_buf->mmal_flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
 		vb2->flags |= V4L2_BUF_FLAG_KEYFRAME;
+	/* Partial frames are expected in slice mode */
+	if (ctx->dev->role == ENCODE && mmal_buf->length &&
+	    ctx->slice_mode == V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_SINGLE &&
+	    !(mmal_buf->mmal_flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END))
+		ctx->num_fragments++;
+	/* and then the client is told which buffer completes the frame */
+	if (ctx->dev->role == ENCODE && mmal_buf->length &&
+	    ctx->slice_mode == V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB &&
+	    (mmal_buf->mmal_flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END))
+		send_frame_end_event(ctx, vb2);
+
+	if (ctx->inline_vectors && port->enabled && mmal_buf->length &&
+	    (mmal_buf->mmal_flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)) {
+		/* Hold the frame until its vectors arrive */
+		complete_vectors_frame(ctx, NULL);
+		WRITE_ONCE(ctx->vectors_frame, vb2);
+		return;
+	}
 
-	vb2_buffer_done(&vb2->vb2_buf, VB2_BUF_STATE_DONE);
+	op_buf_done(buf, VB2_BUF_STATE_DONE);
 	ctx->num_op_buffers++;
 
 	v4l2_dbg(2, debug, &ctx->dev->v4l2_dev, "%s: done %d output buffers\n",
@@ -900,54 +1330,117 @@ static void vb2_to_mmal_buffer(struct m2m_mmal_buffer *buf,
 
 /* device_run() - prepares and starts the device
  *
- * This simulates all the immediate preparations required before starting
- * a device. This will be called by the framework when it decides to schedule
- * a particular instance.
+ * Both queues are buffered, so rather than taking a single src/dst pair per
+ * job, hand every ready CAPTURE buffer and up to the context's budget of
+ * OUTPUT buffers to the VPU, RUN_BATCH at a time. Buffers the VPU could not
+ * take are returned to userspace as errors. The m2m core requeues the context
+ * at the back of the job queue, so contexts get turns weighted by priority.
  */
 static void device_run(void *priv)
 {
 	struct bcm2835_codec_ctx *ctx = priv;
-	struct bcm2835_codec_dev *dev = ctx->dev;
-	struct vb2_v4l2_buffer *src_buf, *dst_buf;
-	struct m2m_mmal_buffer *src_m2m_buf = NULL, *dst_m2m_buf = NULL;
+	struct m2m_mmal_buffer *m2m_bufs[RUN_BATCH];
+	struct mmal_buffer *bufs[RUN_BATCH];
+	bool out1 = has_out1(ctx);
+	struct m2m_mmal_buffer *m2m_buf;
+	struct vb2_v4l2_buffer *vbuf;
 	struct v4l2_m2m_buffer *m2m;
-	int ret;
+	unsigned int num_src = 0, num_dst = 0;
+	unsigned int budget, n, n1, sent, i;
 
 	v4l2_dbg(3, debug, &ctx->dev->v4l2_dev, "%s: off we go\n", __func__);
 
-	src_buf = v4l2_m2m_buf_remove(&ctx->fh.m2m_ctx->out_q_ctx);
-	if (src_buf) {
-		m2m = container_of(src_buf, struct v4l2_m2m_buffer, vb);
-		src_m2m_buf = container_of(m2m, struct m2m_mmal_buffer, m2m);
-		vb2_to_mmal_buffer(src_m2m_buf, src_buf);
+	budget = src_budget(ctx);
+	while (num_src < budget) {
+		for (n = 0; n < RUN_BATCH && num_src + n < budget; n++) {
+			vbuf = v4l2_m2m_buf_remove(&ctx->fh.m2m_ctx->out_q_ctx);
+			if (!vbuf)
+				break;
+
+			m2m = container_of(vbuf, struct v4l2_m2m_buffer, vb);
+			m2m_buf = container_of(m2m, struct m2m_mmal_buffer,
+					       m2m);
+			vb2_to_mmal_buffer(m2m_buf, vbuf);
+			m2m_bufs[n] = m2m_buf;
+			bufs[n] = &m2m_buf->mmal;
+
+			v4l2_dbg(3, debug, &ctx->dev->v4l2_dev, "%s: Submitting ip buffer len %lu, pts %llu, flags %04x\n",
+				 __func__, m2m_buf->mmal.length,
+				 m2m_buf->mmal.pts, m2m_buf->mmal.mmal_flags);
+		}
+		if (!n)
+			break;
 
-		ret = vchiq_mmal_submit_buffer(dev->instance,
-					       &ctx->component->input[0],
-					       &src_m2m_buf->mmal);
-		v4l2_dbg(3, debug, &ctx->dev->v4l2_dev, "%s: Submitted ip buffer len %lu, pts %llu, flags %04x\n",
-			 __func__, src_m2m_buf->mmal.length,
-			 src_m2m_buf->mmal.pts, src_m2m_buf->mmal.mmal_flags);
-		if (ret)
-			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed submitting ip buffer\n",
-				 __func__);
+		src_submitted(ctx, n);
+		sent = vchiq_mmal_submit_buffers(ctx->instance,
+						 &ctx->component->input[0],
+						 bufs, n);
+		if (sent < n)
+			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed submitting %u ip buffers\n",
+				 __func__, n - sent);
+		for (i = sent; i < n; i++) {
+			src_returned(ctx);
+			vb2_buffer_done(&m2m_bufs[i]->m2m.vb.vb2_buf,
+					VB2_BUF_STATE_ERROR);
+		}
+		num_src += n;
 	}
 
-	dst_buf = v4l2_m2m_buf_remove(&ctx->fh.m2m_ctx->cap_q_ctx);
-	if (dst_buf) {
-		m2m = container_of(dst_buf, struct v4l2_m2m_buffer, vb);
-		dst_m2m_buf = container_of(m2m, struct m2m_mmal_buffer, m2m);
-		vb2_to_mmal_buffer(dst_m2m_buf, dst_buf);
+	do {
+		for (n = 0; n < RUN_BATCH; n++) {
+			vbuf = v4l2_m2m_buf_remove(&ctx->fh.m2m_ctx->cap_q_ctx);
+			if (!vbuf)
+				break;
+
+			m2m = container_of(vbuf, struct v4l2_m2m_buffer, vb);
+			m2m_buf = container_of(m2m, struct m2m_mmal_buffer,
+					       m2m);
+			vb2_to_mmal_buffer(m2m_buf, vbuf);
+			m2m_buf->failed = false;
+			atomic_set(&m2m_buf->parts, out1 ? 2 : 1);
+			m2m_bufs[n] = m2m_buf;
+			bufs[n] = &m2m_buf->mmal;
+		}
+		if (!n)
+			break;
 
-		ret = vchiq_mmal_submit_buffer(dev->instance,
-					       &ctx->component->output[0],
-					       &dst_m2m_buf->mmal);
-		if (ret)
-			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed submitting op buffer\n",
-				 __func__);
-	}
+		sent = vchiq_mmal_submit_buffers(ctx->instance,
+						 &ctx->component->output[0],
+						 bufs, n);
+		if (sent < n)
+			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed submitting %u op buffers\n",
+				 __func__, n - sent);
+		/* Neither output has these buffers, so they go straight back */
+		for (i = sent; i < n; i++)
+			vb2_buffer_done(&m2m_bufs[i]->m2m.vb.vb2_buf,
+					VB2_BUF_STATE_ERROR);
+
+		num_dst += n;
+
+		if (out1 && sent) {
+			n1 = sent;
+			for (i = 0; i < n1; i++) {
+				m2m_buf = m2m_bufs[i];
+				m2m_buf->mmal_out1.mmal_flags = 0;
+				m2m_buf->mmal_out1.length =
+					vb2_get_plane_payload(&m2m_buf->m2m.vb.vb2_buf,
+							      1);
+				bufs[i] = &m2m_buf->mmal_out1;
+			}
+			sent = vchiq_mmal_submit_buffers(ctx->instance,
+							 &ctx->component->output[1],
+							 bufs, n1);
+			if (sent < n1)
+				v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed submitting %u op 1 buffers\n",
+					 __func__, n1 - sent);
+			/* Output 0 still has these, so fail just this part */
+			for (i = sent; i < n1; i++)
+				op_buf_done(m2m_bufs[i], VB2_BUF_STATE_ERROR);
+		}
+	} while (n == RUN_BATCH);
 
-	v4l2_dbg(3, debug, &ctx->dev->v4l2_dev, "%s: Submitted src %p, dst %p\n",
-		 __func__, src_m2m_buf, dst_m2m_buf);
+	v4l2_dbg(3, debug, &ctx->dev->v4l2_dev, "%s: Submitted %u src, %u dst\n",
+		 __func__, num_src, num_dst);
 
 	/* Complete the job here. */
 	v4l2_m2m_job_finish(ctx->dev->m2m_dev, ctx->fh.m2m_ctx);
@@ -1003,6 +1496,22 @@ static int vidioc_enum_fmt_vid_out(struct file *file, void *priv,
 	return enum_fmt(f, ctx, false);
 }
 
+static void set_plane1_fmt(struct bcm2835_codec_ctx *ctx,
+			   struct v4l2_format *f)
+{
+	unsigned int size = get_plane1_size(ctx, f->type);
+
+	if (!size)
+		return;
+
+	f->fmt.pix_mp.num_planes = 2;
+	f->fmt.pix_mp.plane_fmt[1].bytesperline =
+		has_out1(ctx) ? ctx->out1.bytesperline : 0;
+	f->fmt.pix_mp.plane_fmt[1].sizeimage = size;
+	memset(f->fmt.pix_mp.plane_fmt[1].reserved, 0,
+	       sizeof(f->fmt.pix_mp.plane_fmt[1].reserved));
+}
+
 static int vidioc_g_fmt(struct bcm2835_codec_ctx *ctx, struct v4l2_format *f)
 {
 	struct vb2_queue *vq;
@@ -1028,6 +1537,7 @@ static int vidioc_g_fmt(struct bcm2835_codec_ctx *ctx, struct v4l2_format *f)
 
 	memset(f->fmt.pix_mp.plane_fmt[0].reserved, 0,
 	       sizeof(f->fmt.pix_mp.plane_fmt[0].reserved));
+	set_plane1_fmt(ctx, f);
 
 	return 0;
 }
@@ -1047,14 +1557,18 @@ static int vidioc_g_fmt_vid_cap(struct file *file, void *priv,
 static int vidioc_try_fmt(struct bcm2835_codec_ctx *ctx, struct v4l2_format *f,
 			  struct bcm2835_codec_fmt *fmt)
 {
+	struct bcm2835_codec_q_data *q_data = get_q_data(ctx, f->type);
+	struct vchiq_mmal_port *port = get_port_data(ctx, f->type);
+	u32 requested_size;
+
 	/*
 	 * The V4L2 specification requires the driver to correct the format
 	 * struct if any of the dimensions is unsupported
 	 */
-	if (f->fmt.pix_mp.width > MAX_W)
-		f->fmt.pix_mp.width = MAX_W;
-	if (f->fmt.pix_mp.height > MAX_H)
-		f->fmt.pix_mp.height = MAX_H;
+	if (f->fmt.pix_mp.width > role_limits[ctx->dev->role].max_w)
+		f->fmt.pix_mp.width = role_limits[ctx->dev->role].max_w;
+	if (f->fmt.pix_mp.height > role_limits[ctx->dev->role].max_h)
+		f->fmt.pix_mp.height = role_limits[ctx->dev->role].max_h;
 
 	if (!fmt->flags & V4L2_FMT_FLAG_COMPRESSED) {
 		/* Only clip min w/h on capture. Treat 0x0 as unknown. */
@@ -1064,22 +1578,45 @@ static int vidioc_try_fmt(struct bcm2835_codec_ctx *ctx, struct v4l2_format *f,
 			f->fmt.pix_mp.height = MIN_H;
 
 		/*
-		 * For decoders the buffer must have a vertical alignment of 16
-		 * lines.
+		 * The codecs work on 16 line slices, so pad the buffer height
+		 * to match. For decoders this is required, and for encoders it
+		 * lets the VPU DMA straight from the buffer rather than
+		 * repacking the planes.
 		 * The selection will reflect any cropping rectangle when only
-		 * some of the pixels are active.
+		 * some of the pixels are active. The ISP has no CAPTURE
+		 * selection, so its padding rows would reach the client, and
+		 * its heights are left alone.
 		 */
-		if (ctx->dev->role == DECODE)
+		if (ctx->dev->role != ISP)
 			f->fmt.pix_mp.height = ALIGN(f->fmt.pix_mp.height, 16);
 	}
+	requested_size = f->fmt.pix_mp.plane_fmt[0].sizeimage;
 	f->fmt.pix_mp.num_planes = 1;
 	f->fmt.pix_mp.plane_fmt[0].bytesperline =
 		get_bytesperline(f->fmt.pix_mp.width, fmt);
 	f->fmt.pix_mp.plane_fmt[0].sizeimage =
-		get_sizeimage(f->fmt.pix_mp.plane_fmt[0].bytesperline,
+		get_sizeimage(ctx, f->fmt.pix_mp.plane_fmt[0].bytesperline,
 			      f->fmt.pix_mp.width, f->fmt.pix_mp.height, fmt);
+	/* Coded formats may be given a larger buffer by the client */
+	if (ctx->dev->role == DECODE &&
+	    (fmt->flags & V4L2_FMT_FLAG_COMPRESSED) &&
+	    requested_size > f->fmt.pix_mp.plane_fmt[0].sizeimage)
+		f->fmt.pix_mp.plane_fmt[0].sizeimage =
+			min_t(u32, requested_size, COMP_BUF_SIZE_MAX);
+	/*
+	 * Report any growth fit_min_buffer will apply on S_FMT. The VPU's
+	 * minimum is only known for the format currently set on the port.
+	 */
+	if (port && q_data && q_data->fmt == fmt &&
+	    !(fmt->flags & V4L2_FMT_FLAG_COMPRESSED) &&
+	    q_data->bytesperline == f->fmt.pix_mp.plane_fmt[0].bytesperline &&
+	    q_data->height == f->fmt.pix_mp.height)
+		f->fmt.pix_mp.plane_fmt[0].sizeimage =
+			max(f->fmt.pix_mp.plane_fmt[0].sizeimage,
+			    port->minimum_buffer.size);
 	memset(f->fmt.pix_mp.plane_fmt[0].reserved, 0,
 	       sizeof(f->fmt.pix_mp.plane_fmt[0].reserved));
+	set_plane1_fmt(ctx, f);
 
 	f->fmt.pix_mp.field = V4L2_FIELD_NONE;
 
@@ -1121,6 +1658,52 @@ static int vidioc_try_fmt_vid_out(struct file *file, void *priv,
 	return vidioc_try_fmt(ctx, f, fmt);
 }
 
+/*
+ * In slice mode the encoder runs in low latency mode and returns each slice
+ * as soon as it is encoded, so a frame may be spread over several CAPTURE
+ * buffers. All buffers of a frame carry the same timestamp, and returning
+ * the one with the final slice queues V4L2_EVENT_BCM2835_CODEC_FRAME_END.
+ * The slice height depends on the frame width, so is reapplied on S_FMT.
+ * Otherwise ask for whole frames in each buffer where possible.
+ */
+static int bcm2835_codec_set_slice_mode(struct bcm2835_codec_ctx *ctx)
+{
+	bool sliced = ctx->slice_mode == V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB;
+	u32 mb_width = DIV_ROUND_UP(ctx->q_data[V4L2_M2M_SRC].crop_width, 16);
+	u32 rows = 0;
+	u32 param;
+	int ret;
+
+	/*
+	 * Avoid fragmenting the buffers over multiple frames (unless
+	 * the frame is bigger than the whole buffer)
+	 */
+	param = !sliced;
+	ret = vchiq_mmal_port_parameter_set(ctx->instance,
+					    &ctx->component->control,
+					    MMAL_PARAMETER_MINIMISE_FRAGMENTATION,
+					    &param, sizeof(param));
+	if (ret)
+		return ret;
+
+	/* MMAL slices are whole macroblock rows. 0 is one slice per frame */
+	if (sliced && mb_width)
+		rows = max_t(u32, ctx->slice_max_mb / mb_width, 1);
+
+	ret = vchiq_mmal_port_parameter_set(ctx->instance,
+					    &ctx->component->output[0],
+					    MMAL_PARAMETER_MB_ROWS_PER_SLICE,
+					    &rows, sizeof(rows));
+	if (ret)
+		return ret;
+
+	param = sliced;
+	return vchiq_mmal_port_parameter_set(ctx->instance,
+					     &ctx->component->output[0],
+					     MMAL_PARAMETER_VIDEO_ENCODE_H264_LOW_LATENCY,
+					     &param, sizeof(param));
+}
+
 static int vidioc_s_fmt(struct bcm2835_codec_ctx *ctx, struct v4l2_format *f,
 			unsigned int requested_height)
 {
@@ -1191,7 +1774,8 @@ static int vidioc_s_fmt(struct bcm2835_codec_ctx *ctx, struct v4l2_format *f,
 
 		q_data_dst->bytesperline =
 			get_bytesperline(f->fmt.pix_mp.width, q_data_dst->fmt);
-		q_data_dst->sizeimage = get_sizeimage(q_data_dst->bytesperline,
+		q_data_dst->sizeimage = get_sizeimage(ctx,
+						      q_data_dst->bytesperline,
 						      q_data_dst->crop_width,
 						      q_data_dst->height,
 						      q_data_dst->fmt);
@@ -1204,18 +1788,22 @@ static int vidioc_s_fmt(struct bcm2835_codec_ctx *ctx, struct v4l2_format *f,
 		return 0;
 
 	setup_mmal_port_format(ctx, q_data, port);
-	ret = vchiq_mmal_port_set_format(ctx->dev->instance, port);
+	ret = vchiq_mmal_port_set_format(ctx->instance, port);
 	if (ret) {
 		v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed vchiq_mmal_port_set_format on port, ret %d\n",
 			 __func__, ret);
 		ret = -EINVAL;
 	}
 
-	if (q_data->sizeimage < port->minimum_buffer.size) {
-		v4l2_err(&ctx->dev->v4l2_dev, "%s: Current buffer size of %u < min buf size %u - driver mismatch to MMAL\n",
-			 __func__, q_data->sizeimage,
-			 port->minimum_buffer.size);
-	}
+	fit_min_buffer(ctx, q_data, port);
+	f->fmt.pix_mp.plane_fmt[0].sizeimage = q_data->sizeimage;
+
+	if (ctx->dev->role == ENCODE &&
+	    f->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE &&
+	    ctx->slice_mode == V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB &&
+	    bcm2835_codec_set_slice_mode(ctx))
+		v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed updating slice size\n",
+			 __func__);
 
 	v4l2_dbg(1, debug, &ctx->dev->v4l2_dev,	"Set format for type %d, wxh: %dx%d, fmt: %08x, size %u\n",
 		 f->type, q_data->crop_width, q_data->height,
@@ -1227,7 +1815,7 @@ static int vidioc_s_fmt(struct bcm2835_codec_ctx *ctx, struct v4l2_format *f,
 						&ctx->q_data[V4L2_M2M_DST];
 
 		setup_mmal_port_format(ctx, q_data_dst, port_dst);
-		ret = vchiq_mmal_port_set_format(ctx->dev->instance, port_dst);
+		ret = vchiq_mmal_port_set_format(ctx->instance, port_dst);
 		if (ret) {
 			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed vchiq_mmal_port_set_format on output port, ret %d\n",
 				 __func__, ret);
@@ -1431,6 +2019,7 @@ static int vidioc_s_parm(struct file *file, void *priv,
 			parm->parm.output.timeperframe.denominator;
 	ctx->framerate_denom =
 			parm->parm.output.timeperframe.numerator;
+	update_enc_comp_sizeimage(ctx);
 
 	parm->parm.output.capability = V4L2_CAP_TIMEPERFRAME;
 
@@ -1460,6 +2049,8 @@ static int vidioc_subscribe_evt(struct v4l2_fh *fh,
 	switch (sub->type) {
 	case V4L2_EVENT_EOS:
 		return v4l2_event_subscribe(fh, sub, 2, NULL);
+	case V4L2_EVENT_BCM2835_CODEC_FRAME_END:
+		return v4l2_event_subscribe(fh, sub, VB2_MAX_FRAME, NULL);
 	case V4L2_EVENT_SOURCE_CHANGE:
 		return v4l2_src_change_event_subscribe(fh, sub);
 	default:
@@ -1478,7 +2069,7 @@ static int bcm2835_codec_set_level_profile(struct bcm2835_codec_ctx *ctx,
 	 * Level and Profile are set via the same MMAL parameter.
 	 * Retrieve the current settings and amend the one that has changed.
 	 */
-	ret = vchiq_mmal_port_parameter_get(ctx->dev->instance,
+	ret = vchiq_mmal_port_parameter_get(ctx->instance,
 					    &ctx->component->output[0],
 					    MMAL_PARAMETER_PROFILE,
 					    &param,
@@ -1551,7 +2142,7 @@ static int bcm2835_codec_set_level_profile(struct bcm2835_codec_ctx *ctx,
 			break;
 		}
 	}
-	ret = vchiq_mmal_port_parameter_set(ctx->dev->instance,
+	ret = vchiq_mmal_port_parameter_set(ctx->instance,
 					    &ctx->component->output[0],
 					    MMAL_PARAMETER_PROFILE,
 					    &param,
@@ -1560,6 +2151,104 @@ static int bcm2835_codec_set_level_profile(struct bcm2835_codec_ctx *ctx,
 	return ret;
 }
 
+/* Update the format of the second ISP output */
+static int bcm2835_codec_set_out1(struct bcm2835_codec_ctx *ctx,
+				  struct v4l2_ctrl *ctrl)
+{
+	struct bcm2835_codec_q_data *q_data = &ctx->out1;
+	struct bcm2835_codec_fmt *fmt = q_data->fmt;
+	unsigned int width = q_data->crop_width;
+	unsigned int height = q_data->crop_height;
+
+	switch (ctrl->id) {
+	case V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_WIDTH:
+		width = ctrl->val ? max_t(unsigned int, ctrl->val, MIN_W) : 0;
+		break;
+	case V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_HEIGHT:
+		height = ctrl->val ? max_t(unsigned int, ctrl->val, MIN_H) : 0;
+		break;
+	default:
+		fmt = find_format_pix_fmt(ctrl->val, ctx->dev, true);
+		if (!fmt || fmt->flags & V4L2_FMT_FLAG_COMPRESSED)
+			return -EINVAL;
+		break;
+	}
+
+	if (fmt == q_data->fmt && width == q_data->crop_width &&
+	    height == q_data->crop_height)
+		return 0;
+
+	/* Changes the CAPTURE format, so not once buffers exist */
+	if (ctx->fh.m2m_ctx &&
+	    vb2_is_busy(v4l2_m2m_get_vq(ctx->fh.m2m_ctx,
+					V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)))
+		return -EBUSY;
+
+	q_data->fmt = fmt;
+	q_data->crop_width = width;
+	q_data->crop_height = height;
+	q_data->height = ALIGN(height, 16);
+	q_data->bytesperline = get_bytesperline(width, fmt);
+	q_data->sizeimage = get_sizeimage(ctx, q_data->bytesperline, width,
+					  q_data->height, fmt);
+
+	return 0;
+}
+
+static u32 bcm2835_codec_enc_param_bit(u32 id)
+{
+	switch (id) {
+	case V4L2_CID_MPEG_VIDEO_H264_MIN_QP:
+		return BIT(0);
+	case V4L2_CID_MPEG_VIDEO_H264_MAX_QP:
+		return BIT(1);
+	case V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP:
+		return BIT(2);
+	case V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP:
+		return BIT(3);
+	case V4L2_CID_MPEG_VIDEO_BITRATE_PEAK:
+		return BIT(4);
+	case V4L2_CID_MPEG_VIDEO_VBV_SIZE:
+		return BIT(5);
+	case V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB:
+		return BIT(6);
+	case V4L2_CID_USER_BCM2835_CODEC_RC_MODEL:
+		return BIT(7);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * The rate control tuning controls default to "let the firmware decide".
+ * Like raspivid, a control is only sent once it has been changed, so a new
+ * component keeps the firmware's own defaults. Once sent it is always sent,
+ * so that setting it back to its default reaches the firmware too.
+ */
+static bool bcm2835_codec_skip_enc_param(struct bcm2835_codec_ctx *ctx,
+					 struct v4l2_ctrl *ctrl)
+{
+	u32 bit = bcm2835_codec_enc_param_bit(ctrl->id);
+
+	if (ctrl->val == ctrl->default_value && !(ctx->enc_params_sent & bit))
+		return true;
+
+	ctx->enc_params_sent |= bit;
+	return false;
+}
+
+static int bcm2835_codec_try_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct bcm2835_codec_ctx *ctx =
+		container_of(ctrl->handler, struct bcm2835_codec_ctx, hdl);
+
+	/* MIN_QP is the master of the QP bounds cluster */
+	if (ctrl == ctx->min_qp && ctx->min_qp->val > ctx->max_qp->val)
+		return -EINVAL;
+
+	return 0;
+}
+
 static int bcm2835_codec_s_ctrl(struct v4l2_ctrl *ctrl)
 {
 	struct bcm2835_codec_ctx *ctx =
@@ -1569,10 +2258,11 @@ static int bcm2835_codec_s_ctrl(struct v4l2_ctrl *ctrl)
 	switch (ctrl->id) {
 	case V4L2_CID_MPEG_VIDEO_BITRATE:
 		ctx->bitrate = ctrl->val;
+		update_enc_comp_sizeimage(ctx);
 		if (!ctx->component)
 			break;
 
-		ret = vchiq_mmal_port_parameter_set(ctx->dev->instance,
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
 						    &ctx->component->output[0],
 						    MMAL_PARAMETER_VIDEO_BIT_RATE,
 						    &ctrl->val,
@@ -1595,7 +2285,7 @@ static int bcm2835_codec_s_ctrl(struct v4l2_ctrl *ctrl)
 			break;
 		}
 
-		ret = vchiq_mmal_port_parameter_set(ctx->dev->instance,
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
 						    &ctx->component->output[0],
 						    MMAL_PARAMETER_RATECONTROL,
 						    &bitrate_mode,
@@ -1606,7 +2296,7 @@ static int bcm2835_codec_s_ctrl(struct v4l2_ctrl *ctrl)
 		if (!ctx->component)
 			break;
 
-		ret = vchiq_mmal_port_parameter_set(ctx->dev->instance,
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
 						    &ctx->component->output[0],
 						    MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER,
 						    &ctrl->val,
@@ -1614,42 +2304,188 @@ static int bcm2835_codec_s_ctrl(struct v4l2_ctrl *ctrl)
 		break;
 
 	case V4L2_CID_MPEG_VIDEO_H264_I_PERIOD:
+		ctx->gop_size = ctrl->val;
+		update_enc_comp_sizeimage(ctx);
 		if (!ctx->component)
 			break;
 
-		ret = vchiq_mmal_port_parameter_set(ctx->dev->instance,
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
 						    &ctx->component->output[0],
 						    MMAL_PARAMETER_INTRAPERIOD,
 						    &ctrl->val,
 						    sizeof(ctrl->val));
 		break;
 
-	case V4L2_CID_MPEG_VIDEO_H264_PROFILE:
-	case V4L2_CID_MPEG_VIDEO_H264_LEVEL:
+	case V4L2_CID_MPEG_VIDEO_H264_MIN_QP:
+	case V4L2_CID_MPEG_VIDEO_H264_MAX_QP: {
+		/* Clustered, so both bounds are set together */
+		struct v4l2_ctrl *bounds[] = { ctx->min_qp, ctx->max_qp };
+		const u32 param_ids[] = {
+			MMAL_PARAMETER_VIDEO_ENCODE_MIN_QUANT,
+			MMAL_PARAMETER_VIDEO_ENCODE_MAX_QUANT,
+		};
+		int i;
+
 		if (!ctx->component)
 			break;
 
-		ret = bcm2835_codec_set_level_profile(ctx, ctrl);
-		break;
-
-	case V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME: {
-		u32 mmal_bool = 1;
+		for (i = 0; i < ARRAY_SIZE(bounds) && !ret; i++) {
+			u32 val = bounds[i]->val;
 
-		if (!ctx->component)
-			break;
+			if (bcm2835_codec_skip_enc_param(ctx, bounds[i]))
+				continue;
 
-		ret = vchiq_mmal_port_parameter_set(ctx->dev->instance,
-						    &ctx->component->output[0],
-						    MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME,
-						    &mmal_bool,
-						    sizeof(mmal_bool));
+			ret = vchiq_mmal_port_parameter_set(ctx->instance,
+							    &ctx->component->output[0],
+							    param_ids[i],
+							    &val, sizeof(val));
+		}
 		break;
 	}
 
-	default:
-		v4l2_err(&ctx->dev->v4l2_dev, "Invalid control\n");
-		return -EINVAL;
-	}
+	case V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP:
+	case V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP:
+	case V4L2_CID_MPEG_VIDEO_BITRATE_PEAK: {
+		u32 param_id, val = ctrl->val;
+
+		if (!ctx->component || bcm2835_codec_skip_enc_param(ctx, ctrl))
+			break;
+
+		switch (ctrl->id) {
+		case V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP:
+			param_id = MMAL_PARAMETER_VIDEO_ENCODE_INITIAL_QUANT;
+			break;
+		case V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP:
+			param_id = MMAL_PARAMETER_VIDEO_ENCODE_QP_P;
+			break;
+		default:
+			param_id = MMAL_PARAMETER_VIDEO_ENCODE_PEAK_RATE;
+			break;
+		}
+
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
+						    &ctx->component->output[0],
+						    param_id, &val, sizeof(val));
+		break;
+	}
+
+	case V4L2_CID_MPEG_VIDEO_VBV_SIZE: {
+		/* kB to bits. 0 removes the limit */
+		u32 limit_bits = ctrl->val * 1024 * 8;
+
+		if (!ctx->component || bcm2835_codec_skip_enc_param(ctx, ctrl))
+			break;
+
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
+						    &ctx->component->output[0],
+						    MMAL_PARAMETER_VIDEO_ENCODE_FRAME_LIMIT_BITS,
+						    &limit_bits,
+						    sizeof(limit_bits));
+		break;
+	}
+
+	case V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB: {
+		struct mmal_parameter_video_intra_refresh param = {
+			.refresh_mode = MMAL_VIDEO_INTRA_REFRESH_CYCLIC,
+			.cir_mbs = ctrl->val,
+		};
+
+		if (!ctx->component || bcm2835_codec_skip_enc_param(ctx, ctrl))
+			break;
+
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
+						    &ctx->component->output[0],
+						    MMAL_PARAMETER_VIDEO_INTRA_REFRESH,
+						    &param, sizeof(param));
+		break;
+	}
+
+	case V4L2_CID_USER_BCM2835_CODEC_RC_MODEL: {
+		u32 rc_model = ctrl->val;
+
+		if (!ctx->component || bcm2835_codec_skip_enc_param(ctx, ctrl))
+			break;
+
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
+						    &ctx->component->output[0],
+						    MMAL_PARAMETER_VIDEO_ENCODE_RC_MODEL,
+						    &rc_model, sizeof(rc_model));
+		break;
+	}
+
+	case V4L2_CID_MPEG_VIDEO_H264_PROFILE:
+	case V4L2_CID_MPEG_VIDEO_H264_LEVEL:
+		if (ctrl->id == V4L2_CID_MPEG_VIDEO_H264_PROFILE)
+			ctx->profile = ctrl->val;
+		else
+			ctx->level = ctrl->val;
+		update_enc_comp_sizeimage(ctx);
+		if (!ctx->component)
+			break;
+
+		ret = bcm2835_codec_set_level_profile(ctx, ctrl);
+		break;
+
+	case V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME: {
+		u32 mmal_bool = 1;
+
+		if (!ctx->component)
+			break;
+
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
+						    &ctx->component->output[0],
+						    MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME,
+						    &mmal_bool,
+						    sizeof(mmal_bool));
+		break;
+	}
+
+	case V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE:
+	case V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB:
+		if (ctrl->id == V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE)
+			ctx->slice_mode = ctrl->val;
+		else
+			ctx->slice_max_mb = ctrl->val;
+		if (!ctx->component)
+			break;
+
+		ret = bcm2835_codec_set_slice_mode(ctx);
+		break;
+
+	case V4L2_CID_USER_BCM2835_CODEC_INLINE_VECTORS: {
+		u32 mmal_bool = ctrl->val;
+
+		/* Changes the CAPTURE format, so not once buffers exist */
+		if (ctx->inline_vectors != !!ctrl->val) {
+			if (ctx->fh.m2m_ctx &&
+			    vb2_is_busy(v4l2_m2m_get_vq(ctx->fh.m2m_ctx,
+					V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)))
+				return -EBUSY;
+			ctx->inline_vectors = ctrl->val;
+		}
+		if (!ctx->component)
+			break;
+
+		ret = vchiq_mmal_port_parameter_set(ctx->instance,
+						    &ctx->component->output[0],
+						    MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS,
+						    &mmal_bool, sizeof(mmal_bool));
+		break;
+	}
+
+	case V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_WIDTH:
+	case V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_HEIGHT:
+	case V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_FOURCC:
+		return bcm2835_codec_set_out1(ctx, ctrl);
+
+	case V4L2_CID_USER_BCM2835_CODEC_PRIORITY:
+		ctx->priority = ctrl->val;
+		break;
+
+	default:
+		v4l2_err(&ctx->dev->v4l2_dev, "Invalid control\n");
+		return -EINVAL;
+	}
 
 	if (ret)
 		v4l2_err(&ctx->dev->v4l2_dev, "Failed setting ctrl %08x, ret %d\n",
@@ -1658,9 +2494,79 @@ static int bcm2835_codec_s_ctrl(struct v4l2_ctrl *ctrl)
 }
 
 static const struct v4l2_ctrl_ops bcm2835_codec_ctrl_ops = {
+	.try_ctrl = bcm2835_codec_try_ctrl,
 	.s_ctrl = bcm2835_codec_s_ctrl,
 };
 
+static const struct v4l2_ctrl_config bcm2835_codec_priority_ctrl = {
+	.ops	= &bcm2835_codec_ctrl_ops,
+	.id	= V4L2_CID_USER_BCM2835_CODEC_PRIORITY,
+	.name	= "Scheduling Priority",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= PRIORITY_MIN,
+	.max	= PRIORITY_MAX,
+	.step	= 1,
+	.def	= PRIORITY_DEFAULT,
+};
+
+static const struct v4l2_ctrl_config bcm2835_codec_inline_vectors_ctrl = {
+	.ops	= &bcm2835_codec_ctrl_ops,
+	.id	= V4L2_CID_USER_BCM2835_CODEC_INLINE_VECTORS,
+	.name	= "Inline Motion Vectors",
+	.type	= V4L2_CTRL_TYPE_BOOLEAN,
+	.max	= 1,
+	.step	= 1,
+	.def	= 0,
+};
+
+static const struct v4l2_ctrl_config bcm2835_codec_out1_width_ctrl = {
+	.ops	= &bcm2835_codec_ctrl_ops,
+	.id	= V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_WIDTH,
+	.name	= "Output 1 Width",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.max	= ISP_MAX_W,
+	.step	= 1,
+	.def	= 0,
+};
+
+static const struct v4l2_ctrl_config bcm2835_codec_out1_height_ctrl = {
+	.ops	= &bcm2835_codec_ctrl_ops,
+	.id	= V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_HEIGHT,
+	.name	= "Output 1 Height",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.max	= ISP_MAX_H,
+	.step	= 1,
+	.def	= 0,
+};
+
+static const struct v4l2_ctrl_config bcm2835_codec_out1_fourcc_ctrl = {
+	.ops	= &bcm2835_codec_ctrl_ops,
+	.id	= V4L2_CID_USER_BCM2835_CODEC_OUTPUT1_FOURCC,
+	.name	= "Output 1 Pixel Format",
+	.type	= V4L2_CTRL_TYPE_INTEGER,
+	.min	= S32_MIN,
+	.max	= S32_MAX,
+	.step	= 1,
+	.def	= V4L2_PIX_FMT_YUV420,
+};
+
+static const char * const bcm2835_codec_rc_model_menu[] = {
+	"Default",
+	"VoWiFi",
+	"CBR",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config bcm2835_codec_rc_model_ctrl = {
+	.ops	= &bcm2835_codec_ctrl_ops,
+	.id	= V4L2_CID_USER_BCM2835_CODEC_RC_MODEL,
+	.name	= "Rate Control Model",
+	.type	= V4L2_CTRL_TYPE_MENU,
+	.max	= MMAL_VIDEO_ENCODER_RC_MODEL_CBR,
+	.def	= MMAL_VIDEO_ENCODER_RC_MODEL_DEFAULT,
+	.qmenu	= bcm2835_codec_rc_model_menu,
+};
+
 static int vidioc_try_decoder_cmd(struct file *file, void *priv,
 				  struct v4l2_decoder_cmd *cmd)
 {
@@ -1714,7 +2620,7 @@ static int vidioc_decoder_cmd(struct file *file, void *priv,
 		if (!ctx->component)
 			break;
 
-		ret = vchiq_mmal_submit_buffer(ctx->dev->instance,
+		ret = vchiq_mmal_submit_buffer(ctx->instance,
 					       &ctx->component->input[0],
 					       &q_data->eos_buffer.mmal);
 		if (ret)
@@ -1785,7 +2691,7 @@ static int vidioc_encoder_cmd(struct file *file, void *priv,
 		if (!ctx->component)
 			break;
 
-		ret = vchiq_mmal_submit_buffer(ctx->dev->instance,
+		ret = vchiq_mmal_submit_buffer(ctx->instance,
 					       &ctx->component->input[0],
 					       &q_data->eos_buffer.mmal);
 		if (ret)
@@ -1808,6 +2714,7 @@ static int vidioc_encoder_cmd(struct file *file, void *priv,
 static int vidioc_enum_framesizes(struct file *file, void *fh,
 				  struct v4l2_frmsizeenum *fsize)
 {
+	struct bcm2835_codec_dev *dev = file2ctx(file)->dev;
 	struct bcm2835_codec_fmt *fmt;
 
 	fmt = find_format_pix_fmt(fsize->pixel_format, file2ctx(file)->dev,
@@ -1826,15 +2733,31 @@ static int vidioc_enum_framesizes(struct file *file, void *fh,
 	fsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
 
 	fsize->stepwise.min_width = MIN_W;
-	fsize->stepwise.max_width = MAX_W;
+	fsize->stepwise.max_width = role_limits[dev->role].max_w;
 	fsize->stepwise.step_width = 1;
 	fsize->stepwise.min_height = MIN_H;
-	fsize->stepwise.max_height = MAX_H;
+	fsize->stepwise.max_height = role_limits[dev->role].max_h;
 	fsize->stepwise.step_height = 1;
 
 	return 0;
 }
 
+/*
+ * REQBUFS aborts if the dmabufs exported for the VPU still reference the
+ * buffers, so drop any imports kept over STREAMOFF first.
+ */
+static int vidioc_reqbufs(struct file *file, void *priv,
+			  struct v4l2_requestbuffers *rb)
+{
+	struct bcm2835_codec_ctx *ctx = file2ctx(file);
+	struct vb2_queue *vq = v4l2_m2m_get_vq(ctx->fh.m2m_ctx, rb->type);
+
+	if (vq && !vb2_is_streaming(vq))
+		bcm2835_codec_unmap_bufs(ctx, vq, false);
+
+	return v4l2_m2m_ioctl_reqbufs(file, priv, rb);
+}
+
 static const struct v4l2_ioctl_ops bcm2835_codec_ioctl_ops = {
 	.vidioc_querycap	= vidioc_querycap,
 
@@ -1848,7 +2771,7 @@ static const struct v4l2_ioctl_ops bcm2835_codec_ioctl_ops = {
 	.vidioc_try_fmt_vid_out_mplane	= vidioc_try_fmt_vid_out,
 	.vidioc_s_fmt_vid_out_mplane	= vidioc_s_fmt_vid_out,
 
-	.vidioc_reqbufs		= v4l2_m2m_ioctl_reqbufs,
+	.vidioc_reqbufs		= vidioc_reqbufs,
 	.vidioc_querybuf	= v4l2_m2m_ioctl_querybuf,
 	.vidioc_qbuf		= v4l2_m2m_ioctl_qbuf,
 	.vidioc_dqbuf		= v4l2_m2m_ioctl_dqbuf,
@@ -1887,6 +2810,15 @@ static int bcm2835_codec_set_ctrls(struct bcm2835_codec_ctx *ctx)
 		V4L2_CID_MPEG_VIDEO_H264_I_PERIOD,
 		V4L2_CID_MPEG_VIDEO_H264_LEVEL,
 		V4L2_CID_MPEG_VIDEO_H264_PROFILE,
+		V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE,
+		V4L2_CID_MPEG_VIDEO_H264_MIN_QP,	/* and MAX_QP */
+		V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP,
+		V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP,
+		V4L2_CID_MPEG_VIDEO_BITRATE_PEAK,
+		V4L2_CID_MPEG_VIDEO_VBV_SIZE,
+		V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB,
+		V4L2_CID_USER_BCM2835_CODEC_RC_MODEL,
+		V4L2_CID_USER_BCM2835_CODEC_INLINE_VECTORS,
 	};
 	int i;
 
@@ -1901,24 +2833,168 @@ static int bcm2835_codec_set_ctrls(struct bcm2835_codec_ctx *ctx)
 	return 0;
 }
 
+/*
+ * Component pool.
+ * Components are only returned to the pool when fully disabled with no
+ * buffers outstanding on any port. bcm2835_codec_create_component reapplies
+ * the port formats and zero copy for every role, and for ENCODE the encoder
+ * parameters too. The rate control tuning is only sent once changed, so an
+ * encoder that had any sent is finalised on release instead. The other roles
+ * set nothing else on the component (the ISP's second output is reconfigured
+ * by bcm2835_codec_setup_out1), so nothing needs resetting on the VPU.
+ */
+static int bcm2835_codec_get_component(struct bcm2835_codec_dev *dev,
+				       struct vchiq_mmal_instance *instance,
+				       struct vchiq_mmal_component **component)
+{
+	struct bcm2835_codec_pool_entry *entry;
+
+	/* only components on the device's own instance are pooled */
+	if (instance != dev->instance)
+		return vchiq_mmal_component_init(instance,
+						 components[dev->role],
+						 component);
+
+	mutex_lock(&dev->comp_pool_lock);
+	entry = list_first_entry_or_null(&dev->comp_pool,
+					 struct bcm2835_codec_pool_entry, list);
+	if (entry) {
+		list_del(&entry->list);
+		dev->comp_pool_count--;
+	}
+	mutex_unlock(&dev->comp_pool_lock);
+
+	if (!entry)
+		return vchiq_mmal_component_init(dev->instance,
+						 components[dev->role],
+						 component);
+
+	*component = entry->component;
+	kfree(entry);
+
+	v4l2_dbg(2, debug, &dev->v4l2_dev, "%s: reusing pooled component\n",
+		 __func__);
+
+	return 0;
+}
+
+static bool bcm2835_codec_port_idle(struct vchiq_mmal_port *port)
+{
+	return !port->enabled && !atomic_read(&port->buffers_with_vpu) &&
+	       list_empty(&port->buffers);
+}
+
+static void bcm2835_codec_put_component(struct bcm2835_codec_dev *dev,
+					struct vchiq_mmal_instance *instance,
+					struct vchiq_mmal_component *component)
+{
+	struct bcm2835_codec_pool_entry *entry = NULL;
+	int i;
+
+	if (instance != dev->instance || component->enabled)
+		goto finalise;
+
+	for (i = 0; i < component->inputs; i++)
+		if (!bcm2835_codec_port_idle(&component->input[i]))
+			goto finalise;
+	for (i = 0; i < component->outputs; i++)
+		if (!bcm2835_codec_port_idle(&component->output[i]))
+			goto finalise;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		goto finalise;
+
+	for (i = 0; i < component->inputs; i++) {
+		component->input[i].buffer_cb = NULL;
+		component->input[i].cb_ctx = NULL;
+	}
+	for (i = 0; i < component->outputs; i++) {
+		component->output[i].buffer_cb = NULL;
+		component->output[i].cb_ctx = NULL;
+	}
+
+	entry->component = component;
+	entry->idle_since = jiffies;
+
+	mutex_lock(&dev->comp_pool_lock);
+	if (dev->comp_pool_count >= component_pool_size) {
+		mutex_unlock(&dev->comp_pool_lock);
+		kfree(entry);
+		goto finalise;
+	}
+	list_add(&entry->list, &dev->comp_pool);
+	dev->comp_pool_count++;
+	mutex_unlock(&dev->comp_pool_lock);
+
+	schedule_delayed_work(&dev->comp_pool_evict,
+			      msecs_to_jiffies(component_pool_timeout_ms));
+	return;
+
+finalise:
+	vchiq_mmal_component_finalise(instance, component);
+}
+
+static void bcm2835_codec_pool_evict(struct work_struct *work)
+{
+	struct bcm2835_codec_dev *dev =
+		container_of(to_delayed_work(work), struct bcm2835_codec_dev,
+			     comp_pool_evict);
+	unsigned long timeout = msecs_to_jiffies(component_pool_timeout_ms);
+	struct bcm2835_codec_pool_entry *entry, *tmp;
+	LIST_HEAD(evict);
+	bool pending;
+
+	mutex_lock(&dev->comp_pool_lock);
+	list_for_each_entry_safe(entry, tmp, &dev->comp_pool, list) {
+		if (time_before(jiffies, entry->idle_since + timeout))
+			continue;
+		list_move(&entry->list, &evict);
+		dev->comp_pool_count--;
+	}
+	pending = dev->comp_pool_count;
+	mutex_unlock(&dev->comp_pool_lock);
+
+	list_for_each_entry_safe(entry, tmp, &evict, list) {
+		vchiq_mmal_component_finalise(dev->instance, entry->component);
+		kfree(entry);
+	}
+
+	if (pending)
+		schedule_delayed_work(&dev->comp_pool_evict, timeout);
+}
+
+static void bcm2835_codec_pool_destroy(struct bcm2835_codec_dev *dev)
+{
+	struct bcm2835_codec_pool_entry *entry, *tmp;
+
+	cancel_delayed_work_sync(&dev->comp_pool_evict);
+
+	list_for_each_entry_safe(entry, tmp, &dev->comp_pool, list) {
+		list_del(&entry->list);
+		vchiq_mmal_component_finalise(dev->instance, entry->component);
+		kfree(entry);
+	}
+	dev->comp_pool_count = 0;
+}
+
 static int bcm2835_codec_create_component(struct bcm2835_codec_ctx *ctx)
 {
 	struct bcm2835_codec_dev *dev = ctx->dev;
 	unsigned int enable = 1;
 	int ret;
 
-	ret = vchiq_mmal_component_init(dev->instance, components[dev->role],
-					&ctx->component);
+	ret = bcm2835_codec_get_component(dev, ctx->instance, &ctx->component);
 	if (ret < 0) {
 		v4l2_err(&dev->v4l2_dev, "%s: failed to create component %s\n",
 			 __func__, components[dev->role]);
 		return -ENOMEM;
 	}
 
-	vchiq_mmal_port_parameter_set(dev->instance, &ctx->component->input[0],
+	vchiq_mmal_port_parameter_set(ctx->instance, &ctx->component->input[0],
 				      MMAL_PARAMETER_ZERO_COPY, &enable,
 				      sizeof(enable));
-	vchiq_mmal_port_parameter_set(dev->instance, &ctx->component->output[0],
+	vchiq_mmal_port_parameter_set(ctx->instance, &ctx->component->output[0],
 				      MMAL_PARAMETER_ZERO_COPY, &enable,
 				      sizeof(enable));
 
@@ -1928,7 +3004,7 @@ static int bcm2835_codec_create_component(struct bcm2835_codec_ctx *ctx)
 	setup_mmal_port_format(ctx, &ctx->q_data[V4L2_M2M_DST],
 			       &ctx->component->output[0]);
 
-	ret = vchiq_mmal_port_set_format(dev->instance,
+	ret = vchiq_mmal_port_set_format(ctx->instance,
 					 &ctx->component->input[0]);
 	if (ret < 0) {
 		v4l2_dbg(1, debug, &dev->v4l2_dev,
@@ -1937,7 +3013,7 @@ static int bcm2835_codec_create_component(struct bcm2835_codec_ctx *ctx)
 		goto destroy_component;
 	}
 
-	ret = vchiq_mmal_port_set_format(dev->instance,
+	ret = vchiq_mmal_port_set_format(ctx->instance,
 					 &ctx->component->output[0]);
 	if (ret < 0) {
 		v4l2_dbg(1, debug, &dev->v4l2_dev,
@@ -1946,15 +3022,14 @@ static int bcm2835_codec_create_component(struct bcm2835_codec_ctx *ctx)
 		goto destroy_component;
 	}
 
+	fit_min_buffer(ctx, &ctx->q_data[V4L2_M2M_SRC],
+		       &ctx->component->input[0]);
+	fit_min_buffer(ctx, &ctx->q_data[V4L2_M2M_DST],
+		       &ctx->component->output[0]);
+
 	if (dev->role == ENCODE) {
 		u32 param = 1;
 
-		if (ctx->q_data[V4L2_M2M_SRC].sizeimage <
-			ctx->component->output[0].minimum_buffer.size)
-			v4l2_err(&dev->v4l2_dev, "buffer size mismatch sizeimage %u < min size %u\n",
-				 ctx->q_data[V4L2_M2M_SRC].sizeimage,
-				 ctx->component->output[0].minimum_buffer.size);
-
 		/* Now we have a component we can set all the ctrls */
 		bcm2835_codec_set_ctrls(ctx);
 
@@ -1962,30 +3037,16 @@ static int bcm2835_codec_create_component(struct bcm2835_codec_ctx *ctx)
 		 * in the H264 header.
 		 */
 		vchiq_mmal_port_parameter_set(
-					ctx->dev->instance,
+					ctx->instance,
 					&ctx->component->output[0],
 					MMAL_PARAMETER_VIDEO_ENCODE_SPS_TIMING,
 					&param, sizeof(param));
 
 		/* Enable inserting headers into the first frame */
-		vchiq_mmal_port_parameter_set(ctx->dev->instance,
+		vchiq_mmal_port_parameter_set(ctx->instance,
 					      &ctx->component->control,
 					      MMAL_PARAMETER_VIDEO_ENCODE_HEADERS_WITH_FRAME,
 					      &param, sizeof(param));
-		/*
-		 * Avoid fragmenting the buffers over multiple frames (unless
-		 * the frame is bigger than the whole buffer)
-		 */
-		vchiq_mmal_port_parameter_set(ctx->dev->instance,
-					      &ctx->component->control,
-					      MMAL_PARAMETER_MINIMISE_FRAGMENTATION,
-					      &param, sizeof(param));
-	} else {
-		if (ctx->q_data[V4L2_M2M_DST].sizeimage <
-			ctx->component->output[0].minimum_buffer.size)
-			v4l2_err(&dev->v4l2_dev, "buffer size mismatch sizeimage %u < min size %u\n",
-				 ctx->q_data[V4L2_M2M_DST].sizeimage,
-				 ctx->component->output[0].minimum_buffer.size);
 	}
 	v4l2_dbg(2, debug, &dev->v4l2_dev, "%s: component created as %s\n",
 		 __func__, components[dev->role]);
@@ -1993,7 +3054,7 @@ static int bcm2835_codec_create_component(struct bcm2835_codec_ctx *ctx)
 	return 0;
 
 destroy_component:
-	vchiq_mmal_component_finalise(ctx->dev->instance, ctx->component);
+	vchiq_mmal_component_finalise(ctx->instance, ctx->component);
 	ctx->component = NULL;
 
 	return ret;
@@ -2003,6 +3064,32 @@ destroy_component:
  * Queue operations
  */
 
+/* Configure the ISP's second output port for ctx->out1 */
+static int bcm2835_codec_setup_out1(struct bcm2835_codec_ctx *ctx)
+{
+	struct vchiq_mmal_port *port = &ctx->component->output[1];
+	unsigned int enable = 1;
+	int ret;
+
+	if (ctx->component->outputs < 2)
+		return -EINVAL;
+
+	vchiq_mmal_port_parameter_set(ctx->instance, port,
+				      MMAL_PARAMETER_ZERO_COPY, &enable,
+				      sizeof(enable));
+
+	setup_mmal_port_format(ctx, &ctx->out1, port);
+	ret = vchiq_mmal_port_set_format(ctx->instance, port);
+	if (ret) {
+		v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed vchiq_mmal_port_set_format on o/p 1 port, ret %d\n",
+			 __func__, ret);
+		return -EINVAL;
+	}
+	fit_min_buffer(ctx, &ctx->out1, port);
+
+	return 0;
+}
+
 static int bcm2835_codec_queue_setup(struct vb2_queue *vq,
 				     unsigned int *nbuffers,
 				     unsigned int *nplanes,
@@ -2013,6 +3100,7 @@ static int bcm2835_codec_queue_setup(struct vb2_queue *vq,
 	struct bcm2835_codec_q_data *q_data;
 	struct vchiq_mmal_port *port;
 	unsigned int size;
+	int ret;
 
 	q_data = get_q_data(ctx, vq->type);
 	if (!q_data)
@@ -2026,10 +3114,31 @@ static int bcm2835_codec_queue_setup(struct vb2_queue *vq,
 
 	size = q_data->sizeimage;
 
-	if (*nplanes)
+	/* The vectors are copied in by the CPU, so need a kernel mapping */
+	if (ctx->dev->role == ENCODE && ctx->inline_vectors &&
+	    !V4L2_TYPE_IS_OUTPUT(vq->type) && vq->memory == VB2_MEMORY_DMABUF)
+		return -EINVAL;
+
+	/* Both REQBUFS and CREATE_BUFS, but not while out1 is streaming */
+	if (has_out1(ctx) && !V4L2_TYPE_IS_OUTPUT(vq->type) &&
+	    !ctx->component->output[1].enabled) {
+		ret = bcm2835_codec_setup_out1(ctx);
+		if (ret)
+			return ret;
+	}
+
+	if (*nplanes) {
+		if (get_plane1_size(ctx, vq->type) &&
+		    (*nplanes < 2 || sizes[1] < get_plane1_size(ctx, vq->type)))
+			return -EINVAL;
 		return sizes[0] < size ? -EINVAL : 0;
+	}
 
 	*nplanes = 1;
+	if (get_plane1_size(ctx, vq->type)) {
+		*nplanes = 2;
+		sizes[1] = get_plane1_size(ctx, vq->type);
+	}
 
 	sizes[0] = size;
 	port->current_buffer.size = size;
@@ -2038,10 +3147,59 @@ static int bcm2835_codec_queue_setup(struct vb2_queue *vq,
 		*nbuffers = port->minimum_buffer.num;
 	/* Add one buffer to take an EOS */
 	port->current_buffer.num = *nbuffers + 1;
+	if (*nplanes > 1 && has_out1(ctx))
+		ctx->component->output[1].current_buffer.num = *nbuffers + 1;
 
 	return 0;
 }
 
+/*
+ * Drop the VPU's import of the buffer, keeping the MMAL header so the buffer
+ * can be submitted again. The import is recreated on next use.
+ */
+static void bcm2835_codec_mmal_buf_unmap(struct mmal_buffer *mmal_buf)
+{
+	mmal_vchi_buffer_unmap(mmal_buf);
+
+	if (mmal_buf->dma_buf) {
+		dma_buf_put(mmal_buf->dma_buf);
+		mmal_buf->dma_buf = NULL;
+	}
+}
+
+/*
+ * Unmap the buffers of @q. With @keep_fitting, buffers still large enough
+ * for the current format keep their imports so that a STREAMOFF/STREAMON
+ * cycle, e.g. for a resolution change, doesn't have to redo them.
+ */
+static void bcm2835_codec_unmap_bufs(struct bcm2835_codec_ctx *ctx,
+				     struct vb2_queue *q, bool keep_fitting)
+{
+	struct bcm2835_codec_q_data *q_data = get_q_data(ctx, q->type);
+	unsigned int plane1_size = get_plane1_size(ctx, q->type);
+	struct vb2_v4l2_buffer *vb2;
+	struct v4l2_m2m_buffer *m2m;
+	struct m2m_mmal_buffer *buf;
+	struct vb2_buffer *vb;
+	int i;
+
+	for (i = 0; i < q->num_buffers; i++) {
+		vb = q->bufs[i];
+		vb2 = to_vb2_v4l2_buffer(vb);
+		m2m = container_of(vb2, struct v4l2_m2m_buffer, vb);
+		buf = container_of(m2m, struct m2m_mmal_buffer, m2m);
+
+		if (keep_fitting &&
+		    vb2_plane_size(vb, 0) >= q_data->sizeimage &&
+		    (!plane1_size || (vb->num_planes > 1 &&
+				      vb2_plane_size(vb, 1) >= plane1_size)))
+			continue;
+
+		bcm2835_codec_mmal_buf_unmap(&buf->mmal);
+		bcm2835_codec_mmal_buf_unmap(&buf->mmal_out1);
+	}
+}
+
 static int bcm2835_codec_mmal_buf_cleanup(struct mmal_buffer *mmal_buf)
 {
 	mmal_vchi_buffer_cleanup(mmal_buf);
@@ -2068,63 +3226,41 @@ static int bcm2835_codec_buf_init(struct vb2_buffer *vb)
 	buf->mmal.buffer = vb2_plane_vaddr(&buf->m2m.vb.vb2_buf, 0);
 	buf->mmal.buffer_size = vb2_plane_size(&buf->m2m.vb.vb2_buf, 0);
 
-	mmal_vchi_buffer_init(ctx->dev->instance, &buf->mmal);
+	mmal_vchi_buffer_init(ctx->instance, &buf->mmal);
+
+	if (vb->num_planes > 1 && ctx->dev->role == ISP) {
+		buf->mmal_out1.buffer = vb2_plane_vaddr(vb, 1);
+		buf->mmal_out1.buffer_size = vb2_plane_size(vb, 1);
+		mmal_vchi_buffer_init(ctx->instance, &buf->mmal_out1);
+	}
 
 	return 0;
 }
 
-static int bcm2835_codec_buf_prepare(struct vb2_buffer *vb)
+/* Get a dmabuf for plane @plane of @vb for the VPU to import */
+static int bcm2835_codec_buf_map(struct bcm2835_codec_ctx *ctx,
+				 struct vb2_buffer *vb, unsigned int plane,
+				 struct mmal_buffer *mmal)
 {
-	struct bcm2835_codec_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
-	struct bcm2835_codec_q_data *q_data;
-	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
-	struct v4l2_m2m_buffer *m2m = container_of(vbuf, struct v4l2_m2m_buffer,
-						   vb);
-	struct m2m_mmal_buffer *buf = container_of(m2m, struct m2m_mmal_buffer,
-						   m2m);
 	struct dma_buf *dma_buf;
 	int ret;
 
-	v4l2_dbg(4, debug, &ctx->dev->v4l2_dev, "%s: type: %d ptr %p\n",
-		 __func__, vb->vb2_queue->type, vb);
-
-	q_data = get_q_data(ctx, vb->vb2_queue->type);
-	if (V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type)) {
-		if (vbuf->field == V4L2_FIELD_ANY)
-			vbuf->field = V4L2_FIELD_NONE;
-		if (vbuf->field != V4L2_FIELD_NONE) {
-			v4l2_err(&ctx->dev->v4l2_dev, "%s field isn't supported\n",
-				 __func__);
-			return -EINVAL;
-		}
-	}
-
-	if (vb2_plane_size(vb, 0) < q_data->sizeimage) {
-		v4l2_err(&ctx->dev->v4l2_dev, "%s data will not fit into plane (%lu < %lu)\n",
-			 __func__, vb2_plane_size(vb, 0),
-			 (long)q_data->sizeimage);
-		return -EINVAL;
-	}
-
-	if (!V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type))
-		vb2_set_plane_payload(vb, 0, q_data->sizeimage);
-
 	switch (vb->memory) {
 	case VB2_MEMORY_DMABUF:
-		dma_buf = dma_buf_get(vb->planes[0].m.fd);
+		dma_buf = dma_buf_get(vb->planes[plane].m.fd);
 
-		if (dma_buf != buf->mmal.dma_buf) {
+		if (dma_buf != mmal->dma_buf) {
 			/* dmabuf either hasn't already been mapped, or it has
 			 * changed.
 			 */
-			if (buf->mmal.dma_buf) {
+			if (mmal->dma_buf) {
 				v4l2_err(&ctx->dev->v4l2_dev,
 					 "%s Buffer changed - why did the core not call cleanup?\n",
 					 __func__);
-				bcm2835_codec_mmal_buf_cleanup(&buf->mmal);
+				bcm2835_codec_mmal_buf_unmap(mmal);
 			}
 
-			buf->mmal.dma_buf = dma_buf;
+			mmal->dma_buf = dma_buf;
 		} else {
 			/* We already have a reference count on the dmabuf, so
 			 * release the one we acquired above.
@@ -2139,12 +3275,12 @@ static int bcm2835_codec_buf_prepare(struct vb2_buffer *vb)
 		 * the index < q->num_buffers, and q->num_buffers only gets
 		 * updated once all the buffers are allocated.
 		 */
-		if (!buf->mmal.dma_buf) {
+		if (!mmal->dma_buf) {
 			ret = vb2_core_expbuf_dmabuf(vb->vb2_queue,
 						     vb->vb2_queue->type,
-						     vb->index, 0,
+						     vb->index, plane,
 						     O_CLOEXEC,
-						     &buf->mmal.dma_buf);
+						     &mmal->dma_buf);
 			if (ret)
 				v4l2_err(&ctx->dev->v4l2_dev,
 					 "%s: Failed to expbuf idx %d, ret %d\n",
@@ -2161,6 +3297,59 @@ static int bcm2835_codec_buf_prepare(struct vb2_buffer *vb)
 	return ret;
 }
 
+static int bcm2835_codec_buf_prepare(struct vb2_buffer *vb)
+{
+	struct bcm2835_codec_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+	struct bcm2835_codec_q_data *q_data;
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct v4l2_m2m_buffer *m2m = container_of(vbuf, struct v4l2_m2m_buffer,
+						   vb);
+	struct m2m_mmal_buffer *buf = container_of(m2m, struct m2m_mmal_buffer,
+						   m2m);
+	unsigned int plane1_size;
+	int ret;
+
+	v4l2_dbg(4, debug, &ctx->dev->v4l2_dev, "%s: type: %d ptr %p\n",
+		 __func__, vb->vb2_queue->type, vb);
+
+	q_data = get_q_data(ctx, vb->vb2_queue->type);
+	if (V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type)) {
+		if (vbuf->field == V4L2_FIELD_ANY)
+			vbuf->field = V4L2_FIELD_NONE;
+		if (vbuf->field != V4L2_FIELD_NONE) {
+			v4l2_err(&ctx->dev->v4l2_dev, "%s field isn't supported\n",
+				 __func__);
+			return -EINVAL;
+		}
+	}
+
+	if (vb2_plane_size(vb, 0) < q_data->sizeimage) {
+		v4l2_err(&ctx->dev->v4l2_dev, "%s data will not fit into plane (%lu < %lu)\n",
+			 __func__, vb2_plane_size(vb, 0),
+			 (long)q_data->sizeimage);
+		return -EINVAL;
+	}
+
+	plane1_size = get_plane1_size(ctx, vb->vb2_queue->type);
+	if (plane1_size && vb2_plane_size(vb, 1) < plane1_size) {
+		v4l2_err(&ctx->dev->v4l2_dev, "%s plane 1 data will not fit (%lu < %u)\n",
+			 __func__, vb2_plane_size(vb, 1), plane1_size);
+		return -EINVAL;
+	}
+
+	if (!V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type)) {
+		vb2_set_plane_payload(vb, 0, q_data->sizeimage);
+		if (plane1_size)
+			vb2_set_plane_payload(vb, 1, plane1_size);
+	}
+
+	ret = bcm2835_codec_buf_map(ctx, vb, 0, &buf->mmal);
+	if (!ret && plane1_size && has_out1(ctx))
+		ret = bcm2835_codec_buf_map(ctx, vb, 1, &buf->mmal_out1);
+
+	return ret;
+}
+
 static void bcm2835_codec_buf_queue(struct vb2_buffer *vb)
 {
 	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
@@ -2185,13 +3374,13 @@ static void bcm2835_codec_buffer_cleanup(struct vb2_buffer *vb)
 		 __func__, ctx, vb);
 
 	bcm2835_codec_mmal_buf_cleanup(&buf->mmal);
+	bcm2835_codec_mmal_buf_cleanup(&buf->mmal_out1);
 }
 
 static int bcm2835_codec_start_streaming(struct vb2_queue *q,
 					 unsigned int count)
 {
 	struct bcm2835_codec_ctx *ctx = vb2_get_drv_priv(q);
-	struct bcm2835_codec_dev *dev = ctx->dev;
 	struct bcm2835_codec_q_data *q_data = get_q_data(ctx, q->type);
 	int ret;
 
@@ -2199,8 +3388,11 @@ static int bcm2835_codec_start_streaming(struct vb2_queue *q,
 		 __func__, q->type, count);
 	q_data->sequence = 0;
 
+	if (!ctx->stream_start_ns)
+		ctx->stream_start_ns = ktime_get_ns();
+
 	if (!ctx->component_enabled) {
-		ret = vchiq_mmal_component_enable(dev->instance,
+		ret = vchiq_mmal_component_enable(ctx->instance,
 						  ctx->component);
 		if (ret)
 			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed enabling component, ret %d\n",
@@ -2215,25 +3407,51 @@ static int bcm2835_codec_start_streaming(struct vb2_queue *q,
 		 * buffer to it as it should only take flags.
 		 */
 		memset(&q_data->eos_buffer, 0, sizeof(q_data->eos_buffer));
-		mmal_vchi_buffer_init(dev->instance,
+		mmal_vchi_buffer_init(ctx->instance,
 				      &q_data->eos_buffer.mmal);
 		q_data->eos_buffer_in_use = false;
 
 		ctx->component->input[0].cb_ctx = ctx;
-		ret = vchiq_mmal_port_enable(dev->instance,
+		ret = vchiq_mmal_port_enable(ctx->instance,
 					     &ctx->component->input[0],
 					     ip_buffer_cb);
 		if (ret)
 			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed enabling i/p port, ret %d\n",
 				 __func__, ret);
 	} else {
+		if (ctx->source_changed) {
+			/*
+			 * Userspace may restart with the existing buffers
+			 * rather than calling S_FMT, so make sure the port
+			 * matches the new format.
+			 */
+			setup_mmal_port_format(ctx, q_data,
+					       &ctx->component->output[0]);
+			ret = vchiq_mmal_port_set_format(ctx->instance,
+							 &ctx->component->output[0]);
+			if (ret)
+				v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed updating o/p port format, ret %d\n",
+					 __func__, ret);
+			ctx->source_changed = false;
+		}
+
 		ctx->component->output[0].cb_ctx = ctx;
-		ret = vchiq_mmal_port_enable(dev->instance,
+		ret = vchiq_mmal_port_enable(ctx->instance,
 					     &ctx->component->output[0],
 					     op_buffer_cb);
 		if (ret)
 			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed enabling o/p port, ret %d\n",
 				 __func__, ret);
+
+		if (!ret && has_out1(ctx)) {
+			ctx->component->output[1].cb_ctx = ctx;
+			ret = vchiq_mmal_port_enable(ctx->instance,
+						     &ctx->component->output[1],
+						     op1_buffer_cb);
+			if (ret)
+				v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed enabling o/p 1 port, ret %d\n",
+					 __func__, ret);
+		}
 	}
 	return ret;
 }
@@ -2241,14 +3459,11 @@ static int bcm2835_codec_start_streaming(struct vb2_queue *q,
 static void bcm2835_codec_stop_streaming(struct vb2_queue *q)
 {
 	struct bcm2835_codec_ctx *ctx = vb2_get_drv_priv(q);
-	struct bcm2835_codec_dev *dev = ctx->dev;
 	struct bcm2835_codec_q_data *q_data = get_q_data(ctx, q->type);
 	struct vchiq_mmal_port *port = get_port_data(ctx, q->type);
+	struct vchiq_mmal_port *port1 = NULL;
 	struct vb2_v4l2_buffer *vbuf;
-	struct vb2_v4l2_buffer *vb2;
-	struct v4l2_m2m_buffer *m2m;
-	struct m2m_mmal_buffer *buf;
-	int ret, i;
+	int ret;
 
 	v4l2_dbg(1, debug, &ctx->dev->v4l2_dev, "%s: type: %d - return buffers\n",
 		 __func__, q->type);
@@ -2270,13 +3485,24 @@ static void bcm2835_codec_stop_streaming(struct vb2_queue *q)
 	}
 
 	/* Disable MMAL port - this will flush buffers back */
-	ret = vchiq_mmal_port_disable(dev->instance, port);
+	ret = vchiq_mmal_port_disable(ctx->instance, port);
 	if (ret)
 		v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed disabling %s port, ret %d\n",
 			 __func__, V4L2_TYPE_IS_OUTPUT(q->type) ? "i/p" : "o/p",
 			 ret);
 
-	while (atomic_read(&port->buffers_with_vpu)) {
+	if (!V4L2_TYPE_IS_OUTPUT(q->type) && ctx->dev->role == ISP) {
+		port1 = &ctx->component->output[1];
+		if (port1->enabled) {
+			ret = vchiq_mmal_port_disable(ctx->instance, port1);
+			if (ret)
+				v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed disabling o/p 1 port, ret %d\n",
+					 __func__, ret);
+		}
+	}
+
+	while (atomic_read(&port->buffers_with_vpu) ||
+	       (port1 && atomic_read(&port1->buffers_with_vpu))) {
 		v4l2_dbg(1, debug, &ctx->dev->v4l2_dev, "%s: Waiting for buffers to be returned - %d outstanding\n",
 			 __func__, atomic_read(&port->buffers_with_vpu));
 		ret = wait_for_completion_timeout(&ctx->frame_cmplt, HZ);
@@ -2288,23 +3514,20 @@ static void bcm2835_codec_stop_streaming(struct vb2_queue *q)
 		}
 	}
 
+	if (!V4L2_TYPE_IS_OUTPUT(q->type))
+		complete_vectors_frame(ctx, NULL);
+
 	/*
-	 * Release the VCSM handle here as otherwise REQBUFS(0) aborts because
-	 * someone is using the dmabuf before giving the driver a chance to do
-	 * anything about it.
+	 * Release the VCSM imports of buffers that no longer fit the format
+	 * (eg after a source change). The rest are kept for the next
+	 * STREAMON, and released in vidioc_reqbufs if the buffers are freed.
 	 */
-	for (i = 0; i < q->num_buffers; i++) {
-		vb2 = to_vb2_v4l2_buffer(q->bufs[i]);
-		m2m = container_of(vb2, struct v4l2_m2m_buffer, vb);
-		buf = container_of(m2m, struct m2m_mmal_buffer, m2m);
-
-		bcm2835_codec_mmal_buf_cleanup(&buf->mmal);
-	}
+	bcm2835_codec_unmap_bufs(ctx, q, true);
 
 	/* If both ports disabled, then disable the component */
 	if (!ctx->component->input[0].enabled &&
 	    !ctx->component->output[0].enabled) {
-		ret = vchiq_mmal_component_disable(dev->instance,
+		ret = vchiq_mmal_component_disable(ctx->instance,
 						   ctx->component);
 		if (ret)
 			v4l2_err(&ctx->dev->v4l2_dev, "%s: Failed enabling component, ret %d\n",
@@ -2362,6 +3585,110 @@ static int queue_init(void *priv, struct vb2_queue *src_vq,
 	return vb2_queue_init(dst_vq);
 }
 
+static int bcm2835_codec_ctx_stats_show(struct seq_file *s, void *v)
+{
+	struct bcm2835_codec_ctx *ctx = s->private;
+	u64 now = ktime_get_ns();
+	u64 elapsed, busy, fps_x100 = 0, occupancy = 0;
+	unsigned int inflight;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->sched_lock, flags);
+	inflight = ctx->src_inflight;
+	busy = ctx->busy_ns;
+	if (inflight)
+		busy += now - ctx->busy_since_ns;
+	elapsed = ctx->stream_start_ns ? now - ctx->stream_start_ns : 0;
+	spin_unlock_irqrestore(&ctx->sched_lock, flags);
+
+	if (elapsed) {
+		fps_x100 = div64_u64((u64)ctx->num_op_buffers * 100 *
+				     NSEC_PER_SEC, elapsed);
+		occupancy = div64_u64(busy * 100, elapsed);
+	}
+
+	seq_printf(s, "priority:      %u\n", ctx->priority);
+	seq_printf(s, "input buffers: %d\n", ctx->num_ip_buffers);
+	seq_printf(s, "output buffers:%d\n", ctx->num_op_buffers);
+	if (ctx->dev->role == ENCODE) {
+		seq_printf(s, "fragments:     %u\n", ctx->num_fragments);
+		seq_printf(s, "buffer size:   %u\n",
+			   ctx->q_data[V4L2_M2M_DST].sizeimage);
+	}
+	seq_printf(s, "inflight:      %u (limit %u)\n", inflight, max_inflight);
+	seq_printf(s, "fps:           %llu.%02llu\n", fps_x100 / 100,
+		   fps_x100 % 100);
+	seq_printf(s, "vpu occupancy: %llu%%\n", occupancy);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(bcm2835_codec_ctx_stats);
+
+/* Pick the MMAL instance for a new context. Called with dev_mutex held. */
+static void bcm2835_codec_get_instance(struct bcm2835_codec_dev *dev,
+				       struct bcm2835_codec_ctx *ctx)
+{
+	struct bcm2835_codec_shard *shard;
+
+	ctx->instance = dev->instance;
+	ctx->shard = NULL;
+
+	if (!contexts_per_instance)
+		return;
+
+	if (dev->instance_users < contexts_per_instance)
+		goto use_dev_instance;
+
+	list_for_each_entry(shard, &dev->shards, list) {
+		if (shard->users < contexts_per_instance) {
+			shard->users++;
+			ctx->instance = shard->instance;
+			ctx->shard = shard;
+			return;
+		}
+	}
+
+	shard = kzalloc(sizeof(*shard), GFP_KERNEL);
+	if (!shard)
+		goto use_dev_instance;
+
+	if (vchiq_mmal_init(&shard->instance)) {
+		v4l2_warn(&dev->v4l2_dev, "%s: failed to open extra MMAL instance\n",
+			  __func__);
+		kfree(shard);
+		goto use_dev_instance;
+	}
+
+	shard->users = 1;
+	list_add_tail(&shard->list, &dev->shards);
+	ctx->instance = shard->instance;
+	ctx->shard = shard;
+	return;
+
+use_dev_instance:
+	dev->instance_users++;
+}
+
+/* Called with dev_mutex held, after the context's component is released. */
+static void bcm2835_codec_put_instance(struct bcm2835_codec_dev *dev,
+				       struct bcm2835_codec_ctx *ctx)
+{
+	struct bcm2835_codec_shard *shard = ctx->shard;
+
+	if (!shard) {
+		if (dev->instance_users)
+			dev->instance_users--;
+		return;
+	}
+
+	if (--shard->users)
+		return;
+
+	list_del(&shard->list);
+	vchiq_mmal_finalise(shard->instance);
+	kfree(shard);
+}
+
 /*
  * File operations
  */
@@ -2370,6 +3697,7 @@ static int bcm2835_codec_open(struct file *file)
 	struct bcm2835_codec_dev *dev = video_drvdata(file);
 	struct bcm2835_codec_ctx *ctx = NULL;
 	struct v4l2_ctrl_handler *hdl;
+	char name[16];
 	int rc = 0;
 
 	if (mutex_lock_interruptible(&dev->dev_mutex)) {
@@ -2382,8 +3710,21 @@ static int bcm2835_codec_open(struct file *file)
 		goto open_unlock;
 	}
 
+	ctx->dev = dev;
+
+	ctx->colorspace = V4L2_COLORSPACE_REC709;
+	ctx->bitrate = 10 * 1000 * 1000;
+
+	ctx->framerate_num = 30;
+	ctx->framerate_denom = 1;
+
+	ctx->gop_size = 60;
+	ctx->level = V4L2_MPEG_VIDEO_H264_LEVEL_4_0;
+	ctx->profile = V4L2_MPEG_VIDEO_H264_PROFILE_HIGH;
+
 	ctx->q_data[V4L2_M2M_SRC].fmt = get_default_format(dev, false);
 	ctx->q_data[V4L2_M2M_DST].fmt = get_default_format(dev, true);
+	ctx->out1.fmt = get_default_format(dev, true);
 
 	ctx->q_data[V4L2_M2M_SRC].crop_width = DEFAULT_WIDTH;
 	ctx->q_data[V4L2_M2M_SRC].crop_height = DEFAULT_HEIGHT;
@@ -2392,7 +3733,7 @@ static int bcm2835_codec_open(struct file *file)
 			get_bytesperline(DEFAULT_WIDTH,
 					 ctx->q_data[V4L2_M2M_SRC].fmt);
 	ctx->q_data[V4L2_M2M_SRC].sizeimage =
-		get_sizeimage(ctx->q_data[V4L2_M2M_SRC].bytesperline,
+		get_sizeimage(ctx, ctx->q_data[V4L2_M2M_SRC].bytesperline,
 			      ctx->q_data[V4L2_M2M_SRC].crop_width,
 			      ctx->q_data[V4L2_M2M_SRC].height,
 			      ctx->q_data[V4L2_M2M_SRC].fmt);
@@ -2404,25 +3745,22 @@ static int bcm2835_codec_open(struct file *file)
 			get_bytesperline(DEFAULT_WIDTH,
 					 ctx->q_data[V4L2_M2M_DST].fmt);
 	ctx->q_data[V4L2_M2M_DST].sizeimage =
-		get_sizeimage(ctx->q_data[V4L2_M2M_DST].bytesperline,
+		get_sizeimage(ctx, ctx->q_data[V4L2_M2M_DST].bytesperline,
 			      ctx->q_data[V4L2_M2M_DST].crop_width,
 			      ctx->q_data[V4L2_M2M_DST].height,
 			      ctx->q_data[V4L2_M2M_DST].fmt);
 
-	ctx->colorspace = V4L2_COLORSPACE_REC709;
-	ctx->bitrate = 10 * 1000 * 1000;
-
-	ctx->framerate_num = 30;
-	ctx->framerate_denom = 1;
+	ctx->priority = PRIORITY_DEFAULT;
+	spin_lock_init(&ctx->sched_lock);
 
 	/* Initialise V4L2 contexts */
 	v4l2_fh_init(&ctx->fh, video_devdata(file));
 	file->private_data = &ctx->fh;
-	ctx->dev = dev;
+	bcm2835_codec_get_instance(dev, ctx);
 	hdl = &ctx->hdl;
 	if (dev->role == ENCODE) {
 		/* Encode controls */
-		v4l2_ctrl_handler_init(hdl, 7);
+		v4l2_ctrl_handler_init(hdl, 19);
 
 		v4l2_ctrl_new_std_menu(hdl, &bcm2835_codec_ctrl_ops,
 				       V4L2_CID_MPEG_VIDEO_BITRATE_MODE,
@@ -2469,25 +3807,63 @@ static int bcm2835_codec_open(struct file *file)
 		v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
 				  V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME,
 				  0, 0, 0, 0);
-		if (hdl->error) {
-			rc = hdl->error;
-			goto free_ctrl_handler;
-		}
-		ctx->fh.ctrl_handler = hdl;
-		v4l2_ctrl_handler_setup(hdl);
+		v4l2_ctrl_new_std_menu(hdl, &bcm2835_codec_ctrl_ops,
+				       V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE,
+				       V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB,
+				       0, V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_SINGLE);
+		v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
+				  V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB,
+				  1, (MAX_W / 16) * (MAX_H / 16),
+				  1, MAX_W / 16);
+		ctx->min_qp = v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
+						V4L2_CID_MPEG_VIDEO_H264_MIN_QP,
+						0, 51, 1, 0);
+		ctx->max_qp = v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
+						V4L2_CID_MPEG_VIDEO_H264_MAX_QP,
+						0, 51, 1, 51);
+		v4l2_ctrl_cluster(2, &ctx->min_qp);
+		v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
+				  V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP,
+				  0, 51, 1, 0);
+		v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
+				  V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP,
+				  0, 51, 1, 0);
+		v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
+				  V4L2_CID_MPEG_VIDEO_BITRATE_PEAK,
+				  0, 25 * 1000 * 1000,
+				  1000, 0);
+		v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
+				  V4L2_CID_MPEG_VIDEO_VBV_SIZE,
+				  0, 65535, 1, 0);
+		v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
+				  V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB,
+				  0, (MAX_W / 16) * (MAX_H / 16), 1, 0);
+		v4l2_ctrl_new_custom(hdl, &bcm2835_codec_rc_model_ctrl, NULL);
+		v4l2_ctrl_new_custom(hdl, &bcm2835_codec_inline_vectors_ctrl,
+				     NULL);
 	} else if (dev->role == DECODE) {
-		v4l2_ctrl_handler_init(hdl, 1);
+		v4l2_ctrl_handler_init(hdl, 2);
 
 		v4l2_ctrl_new_std(hdl, &bcm2835_codec_ctrl_ops,
 				  V4L2_CID_MIN_BUFFERS_FOR_CAPTURE,
 				  1, 1, 1, 1);
-		if (hdl->error) {
-			rc = hdl->error;
-			goto free_ctrl_handler;
-		}
-		ctx->fh.ctrl_handler = hdl;
-		v4l2_ctrl_handler_setup(hdl);
+	} else {
+		v4l2_ctrl_handler_init(hdl, 4);
+
+		v4l2_ctrl_new_custom(hdl, &bcm2835_codec_out1_width_ctrl, NULL);
+		v4l2_ctrl_new_custom(hdl, &bcm2835_codec_out1_height_ctrl,
+				     NULL);
+		v4l2_ctrl_new_custom(hdl, &bcm2835_codec_out1_fourcc_ctrl,
+				     NULL);
+	}
+
+	v4l2_ctrl_new_custom(hdl, &bcm2835_codec_priority_ctrl, NULL);
+	if (hdl->error) {
+		rc = hdl->error;
+		goto free_ctrl_handler;
 	}
+	ctx->fh.ctrl_handler = hdl;
+	v4l2_ctrl_handler_setup(hdl);
 
 	ctx->fh.m2m_ctx = v4l2_m2m_ctx_init(dev->m2m_dev, ctx, &queue_init);
 
@@ -2507,11 +3883,17 @@ static int bcm2835_codec_open(struct file *file)
 	v4l2_fh_add(&ctx->fh);
 	atomic_inc(&dev->num_inst);
 
+	snprintf(name, sizeof(name), "ctx%d", atomic_inc_return(&dev->ctx_id));
+	ctx->debugfs_file = debugfs_create_file(name, 0444, dev->debugfs_dir,
+						ctx,
+						&bcm2835_codec_ctx_stats_fops);
+
 	mutex_unlock(&dev->dev_mutex);
 	return 0;
 
 free_ctrl_handler:
 	v4l2_ctrl_handler_free(hdl);
+	bcm2835_codec_put_instance(dev, ctx);
 	kfree(ctx);
 open_unlock:
 	mutex_unlock(&dev->dev_mutex);
@@ -2526,14 +3908,20 @@ static int bcm2835_codec_release(struct file *file)
 	v4l2_dbg(1, debug, &dev->v4l2_dev, "%s: Releasing instance %p\n",
 		 __func__, ctx);
 
+	debugfs_remove(ctx->debugfs_file);
+
 	v4l2_fh_del(&ctx->fh);
 	v4l2_fh_exit(&ctx->fh);
 	v4l2_ctrl_handler_free(&ctx->hdl);
 	mutex_lock(&dev->dev_mutex);
 	v4l2_m2m_ctx_release(ctx->fh.m2m_ctx);
 
-	if (ctx->component)
-		vchiq_mmal_component_finalise(dev->instance, ctx->component);
+	/* a pooled encoder would carry this context's tuning to the next one */
+	if (ctx->component && ctx->enc_params_sent)
+		vchiq_mmal_component_finalise(ctx->instance, ctx->component);
+	else if (ctx->component)
+		bcm2835_codec_put_component(dev, ctx->instance, ctx->component);
+	bcm2835_codec_put_instance(dev, ctx);
 
 	mutex_unlock(&dev->dev_mutex);
 	kfree(ctx);
@@ -2674,7 +4062,10 @@ static int bcm2835_codec_get_supported_fmts(struct bcm2835_codec_dev *dev)
 	}
 	dev->supported_fmts[1].num_entries = j;
 
-	ret = 0;
+	/* Keep the component for the first context to open the device */
+	bcm2835_codec_put_component(dev, dev->instance, component);
+
+	return 0;
 
 destroy_component:
 	vchiq_mmal_component_finalise(dev->instance, component);
@@ -2705,6 +4096,11 @@ static int bcm2835_codec_create(struct bcm2835_codec_driver *drv,
 	if (ret)
 		return ret;
 
+	INIT_LIST_HEAD(&dev->shards);
+	INIT_LIST_HEAD(&dev->comp_pool);
+	mutex_init(&dev->comp_pool_lock);
+	INIT_DELAYED_WORK(&dev->comp_pool_evict, bcm2835_codec_pool_evict);
+
 	ret = bcm2835_codec_get_supported_fmts(dev);
 	if (ret)
 		goto vchiq_finalise;
@@ -2767,6 +4163,8 @@ static int bcm2835_codec_create(struct bcm2835_codec_driver *drv,
 	v4l2_info(&dev->v4l2_dev, "Device registered as /dev/video%d\n",
 		  vfd->num);
 
+	dev->debugfs_dir = debugfs_create_dir(vfd->name, NULL);
+
 	*new_dev = dev;
 
 	dev->m2m_dev = v4l2_m2m_init(&m2m_ops);
@@ -2785,11 +4183,13 @@ static int bcm2835_codec_create(struct bcm2835_codec_driver *drv,
 	return 0;
 
 err_m2m:
+	debugfs_remove_recursive(dev->debugfs_dir);
 	v4l2_m2m_release(dev->m2m_dev);
 	video_unregister_device(&dev->vfd);
 unreg_dev:
 	v4l2_device_unregister(&dev->v4l2_dev);
 vchiq_finalise:
+	bcm2835_codec_pool_destroy(dev);
 	vchiq_mmal_finalise(dev->instance);
 	return ret;
 }
@@ -2801,10 +4201,12 @@ static int bcm2835_codec_destroy(struct bcm2835_codec_dev *dev)
 
 	v4l2_info(&dev->v4l2_dev, "Removing " MEM2MEM_NAME ", %s\n",
 		  roles[dev->role]);
+	debugfs_remove_recursive(dev->debugfs_dir);
 	v4l2_m2m_unregister_media_controller(dev->m2m_dev);
 	v4l2_m2m_release(dev->m2m_dev);
 	video_unregister_device(&dev->vfd);
 	v4l2_device_unregister(&dev->v4l2_dev);
+	bcm2835_codec_pool_destroy(dev);
 	vchiq_mmal_finalise(dev->instance);
 
 	return 0;
@@ -24,28 +24,65 @@
  * For the VPU allocations the VPU is responsible for triggering the release,
  * and therefore the released message decrements the dma_buf refcount (with the
  * VPU mapping having already been marked as released).
+ *
+ * Imports made through the kernel API are not released straight away when
+ * freed. They are parked on an LRU cache keyed by the source dma_buf so that a
+ * client re-importing the same buffer (eg a decoder recycling its DMABUF pool
+ * over a seek) gets the existing VPU mapping back. A cached import is dropped
+ * as soon as the cache holds the last reference to the source dma_buf, when
+ * the cache grows beyond import_cache_size entries, or when the client drops
+ * the source through vc_sm_cma_import_cache_drop (as mmal_vchi_buffer_unmap
+ * does), as the cache's reference otherwise keeps the source allocated.
+ *
+ * Allocations made through the ioctl of 1MB or more are rounded up to a size
+ * class, and on release all are kept in a pool, still imported on the VPU, so
+ * that the next allocation of the same class needs neither CMA nor a VPU round
+ * trip. Pooled buffers are cleared before being handed out again. The
+ * pool is capped at pool_high_watermark bytes, trimmed back to
+ * pool_low_watermark when it would overflow, and drained under memory
+ * pressure by a shrinker.
+ *
+ * Allocation bytes are charged to the open file that made them, against a
+ * limit taken from max_alloc_per_process at open. Clients are notified
+ * through POLLPRI on the device when they cross 7/8 of their limit, or when
+ * the system is short of memory, so that they can give back buffers before
+ * allocations start failing. POLLPRI stays raised until the client reads a
+ * u32 count of notifications from the device, which clears them.
+ *
+ * Each private data lists the buffers it owns under its own spinlock, so
+ * clients and the VPU release path only contend on the owner's list. The
+ * private data themselves are on an RCU list that debugfs walks.
  */
 
 /* ---- Include Files ----------------------------------------------------- */
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/debugfs.h>
+#include <linux/dma-direct.h>
 #include <linux/dma-mapping.h>
 #include <linux/dma-buf.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/mm.h>
 #include <linux/of_device.h>
+#include <linux/overflow.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
+#include <linux/rculist.h>
 #include <linux/slab.h>
 #include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/syscalls.h>
 #include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <asm/cacheflush.h>
 
 #include "vchiq_connected.h"
@@ -62,9 +99,45 @@
 
 #define VC_SM_RESOURCE_NAME_DEFAULT       "sm-host-resource"
 
+/*
+ * The VPU reaches the first 1GB of SDRAM, through its uncached alias for
+ * buffers shared with the ARM. The VCSM messages only carry 32-bit addresses.
+ * The 36-bit bus addressing of BCM2711 is only understood in VCHIQ pagelists.
+ */
+#define VC_SM_VPU_ALIAS		0xC0000000
+#define VC_SM_VPU_WINDOW	SZ_1G
+
 #define VC_SM_DIR_ROOT_NAME	"vcsm-cma"
 #define VC_SM_STATE		"state"
 
+static unsigned int import_cache_size = 32;
+module_param(import_cache_size, uint, 0644);
+MODULE_PARM_DESC(import_cache_size,
+		 "Number of freed kernel dma_buf imports kept mapped on the VPU");
+
+static unsigned int pool_high_watermark = SZ_16M;
+module_param(pool_high_watermark, uint, 0644);
+MODULE_PARM_DESC(pool_high_watermark,
+		 "Maximum bytes of released allocations kept for reuse (0 to disable the pool)");
+
+static unsigned int pool_low_watermark = SZ_8M;
+module_param(pool_low_watermark, uint, 0644);
+MODULE_PARM_DESC(pool_low_watermark,
+		 "Bytes the allocation pool is trimmed back to when it overflows");
+
+static unsigned long max_alloc_per_process;
+module_param(max_alloc_per_process, ulong, 0644);
+MODULE_PARM_DESC(max_alloc_per_process,
+		 "Default limit on bytes allocated through each open of the device (0 for no limit)");
+
+/* flush_cache_all() only covers the calling CPU, so is no use on SMP */
+#if !defined(CONFIG_ARM64) && !defined(CONFIG_SMP)
+static unsigned int cache_flush_all_threshold;
+module_param(cache_flush_all_threshold, uint, 0644);
+MODULE_PARM_DESC(cache_flush_all_threshold,
+		 "Bytes in one cache op request above which the whole data cache is flushed instead (0 to disable)");
+#endif
+
 /* Private file data associated with each opened device. */
 struct vc_sm_privdata_t {
 	pid_t pid;                      /* PID of creator. */
@@ -72,6 +145,21 @@ struct vc_sm_privdata_t {
 	int restart_sys;		/* Tracks restart on interrupt. */
 	enum vc_sm_msg_type int_action;	/* Interrupted action. */
 	u32 int_trans_id;		/* Interrupted transaction. */
+
+	struct kref ref;		/* Held by the file, each charge and
+					 * each listed buffer.
+					 */
+	struct list_head list;		/* Entry on sm_state->privdata_list. */
+	struct rcu_head rcu;
+
+	spinlock_t lock;		/* Protects buffers. */
+	struct list_head buffers;	/* Resources owned by this client. */
+
+	atomic64_t bytes;		/* Bytes charged. */
+	atomic_t count;			/* Allocations charged. */
+	u64 limit;			/* Bytes allowed, U64_MAX for none. */
+	atomic_t pressure;		/* Near limit since last reported. */
+	int pressure_seen;		/* Last global pressure_seq reported. */
 };
 
 typedef int (*VC_SM_SHOW) (struct seq_file *s, void *v);
@@ -92,9 +180,6 @@ struct sm_state_t {
 	spinlock_t kernelid_map_lock;	/* Spinlock protecting kernelid_map */
 	struct idr kernelid_map;
 
-	struct mutex map_lock;          /* Global map lock. */
-	struct list_head buffer_list;	/* List of buffer. */
-
 	struct vc_sm_privdata_t *data_knl;  /* Kernel internal data tracking. */
 	struct vc_sm_privdata_t *vpu_allocs; /* All allocations from the VPU */
 	struct dentry *dir_root;	/* Debug fs entries root. */
@@ -104,6 +189,27 @@ struct sm_state_t {
 					 * has finished with a resource.
 					 */
 	u32 int_trans_id;		/* Interrupted transaction. */
+
+	struct mutex import_cache_lock;	/* Protects the import cache. */
+	struct list_head import_cache;	/* Freed kernel imports, MRU first. */
+	unsigned int import_cache_count;
+	u64 import_cache_hits;
+	u64 import_cache_misses;
+	u64 import_cache_evictions;
+
+	struct mutex pool_lock;		/* Protects the allocation pool. */
+	struct list_head pool;		/* Released allocations, MRU first. */
+	size_t pool_bytes;
+	u64 pool_hits;
+	u64 pool_misses;
+	struct shrinker pool_shrinker;
+	struct list_head pool_evict;	/* Trimmed by the shrinker, to free. */
+	struct work_struct pool_evict_work;
+
+	struct mutex privdata_lock;	/* Serialises privdata_list updates. */
+	struct list_head privdata_list;	/* All private data, RCU protected. */
+	atomic_t pressure_seq;		/* Bumped on global memory pressure. */
+	wait_queue_head_t pressure_wq;	/* Pollers waiting for pressure. */
 };
 
 struct vc_sm_dma_buf_attachment {
@@ -120,22 +226,33 @@ static int sm_inited;
 
 /* ---- Private Function Prototypes -------------------------------------- */
 
+static void vc_sm_cma_free_priv_data(struct kref *ref);
+static void vc_sm_global_pressure(void);
+
 /* ---- Private Functions ------------------------------------------------ */
 
 static int get_kernel_id(struct vc_sm_buffer *buffer)
 {
 	int handle;
 
+	idr_preload(GFP_KERNEL);
 	spin_lock(&sm_state->kernelid_map_lock);
-	handle = idr_alloc(&sm_state->kernelid_map, buffer, 0, 0, GFP_KERNEL);
+	handle = idr_alloc(&sm_state->kernelid_map, buffer, 0, 0, GFP_NOWAIT);
 	spin_unlock(&sm_state->kernelid_map_lock);
+	idr_preload_end();
 
 	return handle;
 }
 
 static struct vc_sm_buffer *lookup_kernel_id(int handle)
 {
-	return idr_find(&sm_state->kernelid_map, handle);
+	struct vc_sm_buffer *buffer;
+
+	rcu_read_lock();
+	buffer = idr_find(&sm_state->kernelid_map, handle);
+	rcu_read_unlock();
+
+	return buffer;
 }
 
 static void free_kernel_id(int handle)
@@ -172,6 +289,7 @@ static const struct file_operations vc_sm_cma_debug_fs_fops = {
 static int vc_sm_cma_global_state_show(struct seq_file *s, void *v)
 {
 	struct vc_sm_buffer *resource = NULL;
+	struct vc_sm_privdata_t *privdata;
 	int resource_count = 0;
 
 	if (!sm_state)
@@ -179,13 +297,15 @@ static int vc_sm_cma_global_state_show(struct seq_file *s, void *v)
 
 	seq_printf(s, "\nVC-ServiceHandle     %p\n", sm_state->sm_handle);
 
-	/* Log all applicable mapping(s). */
-
-	mutex_lock(&sm_state->map_lock);
+	/*
+	 * Log all applicable mapping(s). The private data list is walked
+	 * under RCU, so only each client's own lock is taken.
+	 */
 	seq_puts(s, "\nResources\n");
-	if (!list_empty(&sm_state->buffer_list)) {
-		list_for_each_entry(resource, &sm_state->buffer_list,
-				    global_buffer_list) {
+	rcu_read_lock();
+	list_for_each_entry_rcu(privdata, &sm_state->privdata_list, list) {
+		spin_lock(&privdata->lock);
+		list_for_each_entry(resource, &privdata->buffers, list) {
 			resource_count++;
 
 			seq_printf(s, "\nResource                %p\n",
@@ -194,6 +314,10 @@ static int vc_sm_cma_global_state_show(struct seq_file *s, void *v)
 				   resource->name);
 			seq_printf(s, "           SIZE         %zu\n",
 				   resource->size);
+			seq_printf(s, "           PID          %d\n",
+				   resource->pid);
+			seq_printf(s, "           CACHED       %d\n",
+				   !!resource->cached);
 			seq_printf(s, "           DMABUF       %p\n",
 				   resource->dma_buf);
 			if (resource->imported) {
@@ -212,29 +336,102 @@ static int vc_sm_cma_global_state_show(struct seq_file *s, void *v)
 			seq_printf(s, "           VC_MAPPING    %d\n",
 				   resource->vpu_state);
 		}
+		spin_unlock(&privdata->lock);
 	}
+	rcu_read_unlock();
 	seq_printf(s, "\n\nTotal resource count:   %d\n\n", resource_count);
 
-	mutex_unlock(&sm_state->map_lock);
+	mutex_lock(&sm_state->import_cache_lock);
+	seq_puts(s, "Import cache\n");
+	seq_printf(s, "           ENTRIES      %u/%u\n",
+		   sm_state->import_cache_count, import_cache_size);
+	seq_printf(s, "           HITS         %llu\n",
+		   sm_state->import_cache_hits);
+	seq_printf(s, "           MISSES       %llu\n",
+		   sm_state->import_cache_misses);
+	seq_printf(s, "           EVICTIONS    %llu\n\n",
+		   sm_state->import_cache_evictions);
+	mutex_unlock(&sm_state->import_cache_lock);
+
+	mutex_lock(&sm_state->pool_lock);
+	seq_puts(s, "Allocation pool\n");
+	seq_printf(s, "           BYTES        %zu/%u\n",
+		   sm_state->pool_bytes, pool_high_watermark);
+	seq_printf(s, "           HITS         %llu\n", sm_state->pool_hits);
+	seq_printf(s, "           MISSES       %llu\n",
+		   sm_state->pool_misses);
+	list_for_each_entry(resource, &sm_state->pool, list)
+		seq_printf(s, "           FREE         %zu\n", resource->size);
+	mutex_unlock(&sm_state->pool_lock);
+
+	seq_puts(s, "\nPer process\n");
+	rcu_read_lock();
+	list_for_each_entry_rcu(privdata, &sm_state->privdata_list, list) {
+		seq_printf(s, "           PID %-8d %d buffers, %lld bytes",
+			   privdata->pid, atomic_read(&privdata->count),
+			   (long long)atomic64_read(&privdata->bytes));
+		if (privdata->limit != U64_MAX)
+			seq_printf(s, ", limit %llu", privdata->limit);
+		seq_putc(s, '\n');
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+/*
+ * Converts a DMA address of our device into the address the VPU uses for it.
+ * Fails if any of the buffer is outside the VPU's window, rather than handing
+ * the VPU a truncated or re-aliased address for some other memory.
+ */
+static int vc_sm_vpu_addr(dma_addr_t dma_addr, size_t size, u32 *vpu_addr)
+{
+	phys_addr_t phys = dma_to_phys(&sm_state->pdev->dev, dma_addr);
+
+	if (phys >= VC_SM_VPU_WINDOW || size > VC_SM_VPU_WINDOW - phys) {
+		pr_err("%s: dma_addr %pad (%zu bytes) is outside the VPU window\n",
+		       __func__, &dma_addr, size);
+		return -EINVAL;
+	}
 
+	*vpu_addr = VC_SM_VPU_ALIAS | (u32)phys;
 	return 0;
 }
 
 /*
  * Adds a buffer to the private data list which tracks all the allocated
- * data.
+ * data. The buffer holds a reference on the private data while listed.
  */
 static void vc_sm_add_resource(struct vc_sm_privdata_t *privdata,
 			       struct vc_sm_buffer *buffer)
 {
-	mutex_lock(&sm_state->map_lock);
-	list_add(&buffer->global_buffer_list, &sm_state->buffer_list);
-	mutex_unlock(&sm_state->map_lock);
+	kref_get(&privdata->ref);
+	buffer->owner = privdata;
+
+	spin_lock(&privdata->lock);
+	list_add(&buffer->list, &privdata->buffers);
+	spin_unlock(&privdata->lock);
 
 	pr_debug("[%s]: added buffer %p (name %s, size %zu)\n",
 		 __func__, buffer, buffer->name, buffer->size);
 }
 
+/* Takes a buffer off the list of its owner, if it is on one. */
+static void vc_sm_del_resource(struct vc_sm_buffer *buffer)
+{
+	struct vc_sm_privdata_t *privdata = buffer->owner;
+
+	if (!privdata)
+		return;
+
+	spin_lock(&privdata->lock);
+	list_del(&buffer->list);
+	spin_unlock(&privdata->lock);
+
+	buffer->owner = NULL;
+	kref_put(&privdata->ref, vc_sm_cma_free_priv_data);
+}
+
 /*
  * Cleans up imported dmabuf.
  */
@@ -286,6 +483,15 @@ static void vc_sm_vpu_free(struct vc_sm_buffer *buffer)
 	}
 }
 
+/*
+ * Cached allocations have no kernel mapping, so that the only CPU mappings are
+ * the cacheable ones given to userspace and the linear map.
+ */
+static unsigned long vc_sm_alloc_attrs(struct vc_sm_buffer *buffer)
+{
+	return buffer->cached ? DMA_ATTR_NO_KERNEL_MAPPING : 0;
+}
+
 /*
  * Release an allocation.
  * All refcounting is done via the dma buf object.
@@ -321,14 +527,25 @@ static void vc_sm_release_resource(struct vc_sm_buffer *buffer)
 			       __func__, buffer);
 		buffer->import.dma_buf = NULL;
 	} else {
-		dma_free_coherent(&sm_state->pdev->dev, buffer->size,
-				  buffer->cookie, buffer->dma_addr);
+		struct sg_table *sgt = buffer->alloc.sg_table;
+
+		if (sgt) {
+			if (buffer->cached)
+				dma_unmap_sg_attrs(&sm_state->pdev->dev,
+						   sgt->sgl, sgt->orig_nents,
+						   DMA_BIDIRECTIONAL,
+						   DMA_ATTR_SKIP_CPU_SYNC);
+			sg_free_table(sgt);
+			kfree(sgt);
+			buffer->alloc.sg_table = NULL;
+		}
+		dma_free_attrs(&sm_state->pdev->dev, buffer->size,
+			       buffer->cookie, buffer->dma_addr,
+			       vc_sm_alloc_attrs(buffer));
 	}
 
 	/* Free our buffer. Start by removing it from the list */
-	mutex_lock(&sm_state->map_lock);
-	list_del(&buffer->global_buffer_list);
-	mutex_unlock(&sm_state->map_lock);
+	vc_sm_del_resource(buffer);
 
 	pr_debug("%s: Release our allocation - done\n", __func__);
 	mutex_unlock(&buffer->lock);
@@ -342,6 +559,281 @@ defer:
 	mutex_unlock(&buffer->lock);
 }
 
+/*
+ * A cached import is stale once the VPU has dropped its mapping, or once the
+ * cache holds the only reference to the source dma_buf, as nobody can ask
+ * for it again.
+ */
+static bool vc_sm_import_cache_stale(struct vc_sm_buffer *buffer)
+{
+	bool stale;
+
+	mutex_lock(&buffer->lock);
+	stale = buffer->vpu_state != VPU_MAPPED ||
+		file_count(buffer->import.dma_buf->file) <= 1;
+	mutex_unlock(&buffer->lock);
+
+	return stale;
+}
+
+/*
+ * Moves stale entries from the import cache onto @evict. Entries beyond @max
+ * are also evicted, least recently used first.
+ * Must be called with import_cache_lock held.
+ */
+static void vc_sm_import_cache_trim(struct list_head *evict, unsigned int max)
+{
+	struct vc_sm_buffer *buffer, *tmp;
+
+	list_for_each_entry_safe_reverse(buffer, tmp, &sm_state->import_cache,
+					 cache_list) {
+		if (sm_state->import_cache_count <= max &&
+		    !vc_sm_import_cache_stale(buffer))
+			continue;
+
+		list_move(&buffer->cache_list, evict);
+		sm_state->import_cache_count--;
+		sm_state->import_cache_evictions++;
+	}
+}
+
+/*
+ * Releases the imports evicted by vc_sm_import_cache_trim. This unmaps them on
+ * the VPU, so must be called without import_cache_lock held.
+ */
+static void vc_sm_import_cache_release(struct list_head *evict)
+{
+	struct vc_sm_buffer *buffer, *tmp;
+
+	list_for_each_entry_safe(buffer, tmp, evict, cache_list) {
+		list_del_init(&buffer->cache_list);
+		pr_debug("%s: evicting buffer %p, dmabuf %p\n", __func__,
+			 buffer, buffer->import.dma_buf);
+		dma_buf_put(buffer->dma_buf);
+	}
+}
+
+/*
+ * Looks up a cached import of @src_dmabuf, removing it from the cache if
+ * found. The caller takes over the cache's reference on the returned buffer.
+ */
+static struct vc_sm_buffer *
+vc_sm_import_cache_lookup(struct dma_buf *src_dmabuf)
+{
+	struct vc_sm_buffer *buffer, *cached = NULL;
+	LIST_HEAD(evict);
+
+	mutex_lock(&sm_state->import_cache_lock);
+	vc_sm_import_cache_trim(&evict, import_cache_size);
+	list_for_each_entry(buffer, &sm_state->import_cache, cache_list) {
+		if (buffer->import.dma_buf == src_dmabuf &&
+		    !vc_sm_import_cache_stale(buffer)) {
+			list_del_init(&buffer->cache_list);
+			sm_state->import_cache_count--;
+			cached = buffer;
+			break;
+		}
+	}
+	if (cached)
+		sm_state->import_cache_hits++;
+	else
+		sm_state->import_cache_misses++;
+	mutex_unlock(&sm_state->import_cache_lock);
+
+	vc_sm_import_cache_release(&evict);
+
+	return cached;
+}
+
+/*
+ * Rounds a frame sized allocation up to its pool size class, so that
+ * near-identical requests (eg frames whose stride padding differs) share
+ * pooled buffers. Smaller allocations are only reused at their exact
+ * page-aligned size, as rounding those up would waste too much.
+ */
+static size_t vc_sm_pool_class_size(size_t size)
+{
+	if (!pool_high_watermark || size < SZ_1M)
+		return size;
+	return ALIGN(size, SZ_256K);
+}
+
+/*
+ * Releases pooled buffers on @evict: unmaps them on the VPU and frees the
+ * memory, possibly deferred until the VPU confirms the release.
+ * Must be called without pool_lock held.
+ */
+static void vc_sm_pool_release(struct list_head *evict)
+{
+	struct vc_sm_buffer *buffer, *tmp;
+
+	list_for_each_entry_safe(buffer, tmp, evict, list) {
+		list_del(&buffer->list);
+		/* Kernel owned until the VPU has released it */
+		vc_sm_add_resource(sm_state->data_knl, buffer);
+
+		mutex_lock(&buffer->lock);
+		vc_sm_vpu_free(buffer);
+		vc_sm_release_resource(buffer);
+	}
+}
+
+/*
+ * Moves pooled buffers onto @evict, least recently used first, until the pool
+ * holds no more than @max bytes. Returns the number of bytes moved.
+ * Must be called with pool_lock held.
+ */
+static size_t vc_sm_pool_trim(struct list_head *evict, size_t max)
+{
+	struct vc_sm_buffer *buffer;
+	size_t freed = 0;
+
+	while (sm_state->pool_bytes > max) {
+		buffer = list_last_entry(&sm_state->pool, struct vc_sm_buffer,
+					 list);
+		list_move(&buffer->list, evict);
+		sm_state->pool_bytes -= buffer->size;
+		freed += buffer->size;
+	}
+
+	return freed;
+}
+
+/*
+ * Takes a pooled buffer of exactly @size bytes and the requested caching, or
+ * returns NULL.
+ */
+static struct vc_sm_buffer *vc_sm_pool_get(size_t size, bool cached)
+{
+	struct vc_sm_buffer *buffer, *found = NULL;
+
+	if (!pool_high_watermark)
+		return NULL;
+
+	mutex_lock(&sm_state->pool_lock);
+	list_for_each_entry(buffer, &sm_state->pool, list) {
+		if (buffer->size == size && !!buffer->cached == cached) {
+			list_del(&buffer->list);
+			sm_state->pool_bytes -= size;
+			found = buffer;
+			break;
+		}
+	}
+	if (found)
+		sm_state->pool_hits++;
+	else
+		sm_state->pool_misses++;
+	mutex_unlock(&sm_state->pool_lock);
+
+	return found;
+}
+
+/*
+ * Offers a released allocation to the pool. The VPU mapping and the memory
+ * are retained, but the dma_buf is going away. Returns true if the pool took
+ * it, in which case the caller must not release it.
+ * Must be called with the buffer lock held.
+ */
+static bool vc_sm_pool_put(struct vc_sm_buffer *buffer)
+{
+	LIST_HEAD(evict);
+	bool pooled = false;
+
+	if (!pool_high_watermark || buffer->imported ||
+	    buffer->vpu_allocated || buffer->vpu_state != VPU_MAPPED ||
+	    vc_sm_pool_class_size(buffer->size) != buffer->size ||
+	    buffer->size > pool_high_watermark)
+		return false;
+
+	/* Off the resource list; the pool reuses the list head. */
+	vc_sm_del_resource(buffer);
+
+	buffer->dma_buf = NULL;
+	buffer->private = NULL;
+	buffer->pid = 0;
+
+	mutex_lock(&sm_state->pool_lock);
+	if (sm_state->pool_bytes + buffer->size > pool_high_watermark)
+		vc_sm_pool_trim(&evict,
+				min_t(size_t, pool_low_watermark,
+				      pool_high_watermark - buffer->size));
+	list_add(&buffer->list, &sm_state->pool);
+	sm_state->pool_bytes += buffer->size;
+	pooled = true;
+	mutex_unlock(&sm_state->pool_lock);
+
+	vc_sm_pool_release(&evict);
+
+	return pooled;
+}
+
+/*
+ * Takes every buffer out of the pool, including those the shrinker has
+ * trimmed but not yet freed, and releases them. Returns the bytes released.
+ */
+static size_t vc_sm_pool_drain(void)
+{
+	LIST_HEAD(evict);
+	size_t freed;
+
+	flush_work(&sm_state->pool_evict_work);
+
+	mutex_lock(&sm_state->pool_lock);
+	freed = vc_sm_pool_trim(&evict, 0);
+	mutex_unlock(&sm_state->pool_lock);
+
+	vc_sm_pool_release(&evict);
+
+	return freed;
+}
+
+/*
+ * Releasing a pooled buffer takes buffer locks, allocates and may block on
+ * the VPU command pool, none of which is safe in reclaim. The shrinker only
+ * trims the pool, leaving the release to this worker.
+ */
+static void vc_sm_pool_evict_work(struct work_struct *work)
+{
+	LIST_HEAD(evict);
+
+	mutex_lock(&sm_state->pool_lock);
+	list_splice_init(&sm_state->pool_evict, &evict);
+	mutex_unlock(&sm_state->pool_lock);
+
+	vc_sm_pool_release(&evict);
+}
+
+static unsigned long vc_sm_pool_shrink_count(struct shrinker *shrinker,
+					     struct shrink_control *sc)
+{
+	return READ_ONCE(sm_state->pool_bytes) >> PAGE_SHIFT;
+}
+
+static unsigned long vc_sm_pool_shrink_scan(struct shrinker *shrinker,
+					    struct shrink_control *sc)
+{
+	size_t target, freed;
+
+	if (!mutex_trylock(&sm_state->pool_lock))
+		return SHRINK_STOP;
+
+	target = sc->nr_to_scan << PAGE_SHIFT;
+	if (target > sm_state->pool_bytes)
+		target = sm_state->pool_bytes;
+	freed = vc_sm_pool_trim(&sm_state->pool_evict,
+				sm_state->pool_bytes - target);
+	mutex_unlock(&sm_state->pool_lock);
+
+	if (freed)
+		schedule_work(&sm_state->pool_evict_work);
+
+	/* The pool is exhausted, so ask the clients to give memory back. */
+	if ((freed >> PAGE_SHIFT) < sc->nr_to_scan)
+		vc_sm_global_pressure();
+
+	return freed >> PAGE_SHIFT;
+}
+
 /* Create support for private data tracking. */
 static struct vc_sm_privdata_t *vc_sm_cma_create_priv_data(pid_t id)
 {
@@ -357,10 +849,90 @@ static struct vc_sm_privdata_t *vc_sm_cma_create_priv_data(pid_t id)
 	snprintf(alloc_name, sizeof(alloc_name), "%d", id);
 
 	file_data->pid = id;
+	kref_init(&file_data->ref);
+	spin_lock_init(&file_data->lock);
+	INIT_LIST_HEAD(&file_data->buffers);
+	atomic64_set(&file_data->bytes, 0);
+	atomic_set(&file_data->count, 0);
+	atomic_set(&file_data->pressure, 0);
+	file_data->limit = max_alloc_per_process ? : U64_MAX;
+	file_data->pressure_seen = atomic_read(&sm_state->pressure_seq);
+
+	mutex_lock(&sm_state->privdata_lock);
+	list_add_tail_rcu(&file_data->list, &sm_state->privdata_list);
+	mutex_unlock(&sm_state->privdata_lock);
 
 	return file_data;
 }
 
+static void vc_sm_cma_free_priv_data(struct kref *ref)
+{
+	struct vc_sm_privdata_t *file_data =
+		container_of(ref, struct vc_sm_privdata_t, ref);
+
+	mutex_lock(&sm_state->privdata_lock);
+	list_del_rcu(&file_data->list);
+	mutex_unlock(&sm_state->privdata_lock);
+
+	/* debugfs may still be walking past it. */
+	kfree_rcu(file_data, rcu);
+}
+
+/*
+ * Flags system-wide memory pressure to every client polling the device.
+ * Safe from reclaim context.
+ */
+static void vc_sm_global_pressure(void)
+{
+	atomic_inc(&sm_state->pressure_seq);
+	wake_up_interruptible(&sm_state->pressure_wq);
+}
+
+static bool vc_sm_pressure_pending(struct vc_sm_privdata_t *private)
+{
+	return atomic_read(&private->pressure) ||
+	       READ_ONCE(private->pressure_seen) !=
+	       atomic_read(&sm_state->pressure_seq);
+}
+
+/*
+ * Charges @size bytes to @private, failing if that would take it over its
+ * limit. Each charge holds a reference on @private, so that it can be dropped
+ * by a dma_buf release after the file has been closed.
+ */
+static int vc_sm_charge(struct vc_sm_privdata_t *private, size_t size)
+{
+	u64 limit = READ_ONCE(private->limit);
+	u64 used = atomic64_add_return(size, &private->bytes);
+	u64 high = limit - (limit >> 3);
+
+	if (used > limit) {
+		atomic64_sub(size, &private->bytes);
+		pr_debug("[%s]: pid %d over its limit of %llu bytes allocating %zu\n",
+			 __func__, private->pid, limit, size);
+		atomic_set(&private->pressure, 1);
+		wake_up_interruptible(&sm_state->pressure_wq);
+		return -ENOMEM;
+	}
+
+	/* Warn the client once on crossing 7/8 of its limit. */
+	if (limit != U64_MAX && used > high && used - size <= high) {
+		atomic_set(&private->pressure, 1);
+		wake_up_interruptible(&sm_state->pressure_wq);
+	}
+
+	atomic_inc(&private->count);
+	kref_get(&private->ref);
+	return 0;
+}
+
+static void vc_sm_uncharge(struct vc_sm_privdata_t *private, size_t size)
+{
+	atomic64_sub(size, &private->bytes);
+	atomic_dec(&private->count);
+	kref_put(&private->ref, vc_sm_cma_free_priv_data);
+}
+
 /* Dma buf operations for use with our own allocations */
 
 static int vc_sm_dma_buf_attach(struct dma_buf *dmabuf,
@@ -402,6 +974,7 @@ static int vc_sm_dma_buf_attach(struct dma_buf *dmabuf,
 		wr = sg_next(wr);
 	}
 
+	a->dev = attachment->dev;
 	a->dma_dir = DMA_NONE;
 	attachment->priv = a;
 
@@ -486,6 +1059,8 @@ static void vc_sm_unmap_dma_buf(struct dma_buf_attachment *attachment,
 	dma_unmap_sg(attachment->dev, table->sgl, table->nents, direction);
 }
 
+static const struct vm_operations_struct vc_sm_vm_ops = { };
+
 static int vc_sm_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
 {
 	struct vc_sm_buffer *buf = dmabuf->priv;
@@ -499,8 +1074,14 @@ static int vc_sm_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
 	/* now map it to userspace */
 	vma->vm_pgoff = 0;
 
-	ret = dma_mmap_coherent(&sm_state->pdev->dev, vma, buf->cookie,
-				buf->dma_addr, buf->size);
+	if (buf->cached)
+		ret = remap_pfn_range(vma, vma->vm_start,
+				      page_to_pfn(sg_page(buf->alloc.sg_table->sgl)),
+				      vma->vm_end - vma->vm_start,
+				      vma->vm_page_prot);
+	else
+		ret = dma_mmap_coherent(&sm_state->pdev->dev, vma,
+					buf->cookie, buf->dma_addr, buf->size);
 
 	if (ret) {
 		pr_err("Remapping memory failed, error: %d\n", ret);
@@ -508,6 +1089,9 @@ static int vc_sm_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
 	}
 
 	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	/* Lets the cache maintenance ioctl find the buffer again. */
+	vma->vm_ops = &vc_sm_vm_ops;
+	vma->vm_private_data = buf;
 
 	mutex_unlock(&buf->lock);
 
@@ -533,6 +1117,18 @@ static void vc_sm_dma_buf_release(struct dma_buf *dmabuf)
 
 	buffer->in_use = 0;
 
+	if (buffer->charged) {
+		buffer->charged = 0;
+		vc_sm_uncharge(buffer->private, buffer->size);
+	}
+
+	/* Keep the allocation, still mapped on the VPU, for reuse. */
+	if (vc_sm_pool_put(buffer)) {
+		pr_debug("%s buffer %p pooled\n", __func__, buffer);
+		mutex_unlock(&buffer->lock);
+		return;
+	}
+
 	/* Unmap on the VPU */
 	vc_sm_vpu_free(buffer);
 	pr_debug("%s vpu_free done\n", __func__);
@@ -563,8 +1159,14 @@ static int vc_sm_dma_buf_begin_cpu_access(struct dma_buf *dmabuf,
 	if (!buf)
 		return -EFAULT;
 
+	/* Coherent allocations need no maintenance. */
+	if (!buf->cached)
+		return 0;
+
 	mutex_lock(&buf->lock);
 
+	dma_sync_sg_for_cpu(&sm_state->pdev->dev, buf->alloc.sg_table->sgl,
+			    buf->alloc.sg_table->orig_nents, direction);
 	list_for_each_entry(a, &buf->attachments, list) {
 		dma_sync_sg_for_cpu(a->dev, a->sg_table.sgl,
 				    a->sg_table.nents, direction);
@@ -586,8 +1188,14 @@ static int vc_sm_dma_buf_end_cpu_access(struct dma_buf *dmabuf,
 	if (!buf)
 		return -EFAULT;
 
+	/* Coherent allocations need no maintenance. */
+	if (!buf->cached)
+		return 0;
+
 	mutex_lock(&buf->lock);
 
+	dma_sync_sg_for_device(&sm_state->pdev->dev, buf->alloc.sg_table->sgl,
+			       buf->alloc.sg_table->orig_nents, direction);
 	list_for_each_entry(a, &buf->attachments, list) {
 		dma_sync_sg_for_device(a->dev, a->sg_table.sgl,
 				       a->sg_table.nents, direction);
@@ -762,80 +1370,140 @@ static const struct dma_buf_ops dma_buf_import_ops = {
 	.unmap = vc_sm_import_dma_buf_kunmap,
 };
 
-/* Import a dma_buf to be shared with VC. */
-int
-vc_sm_cma_import_dmabuf_internal(struct vc_sm_privdata_t *private,
-				 struct dma_buf *dma_buf,
-				 int fd,
-				 struct dma_buf **imported_buf)
+/*
+ * Returns the size of the block described by @sgt if it is contiguous in bus
+ * address space, or 0 if it is not.
+ * The VPU can only import a single base and size, but exporters frequently
+ * describe a contiguous allocation with one entry per page or per chunk, so
+ * walk the table rather than insisting on a single entry.
+ */
+static size_t vc_sm_sgt_contig_size(struct sg_table *sgt)
 {
-	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
-	struct vc_sm_buffer *buffer = NULL;
-	struct vc_sm_import import = { };
-	struct vc_sm_import_result result = { };
-	struct dma_buf_attachment *attach = NULL;
-	struct sg_table *sgt = NULL;
-	dma_addr_t dma_addr;
-	int ret = 0;
-	int status;
+	dma_addr_t expected = sg_dma_address(sgt->sgl);
+	struct scatterlist *s;
+	size_t size = 0;
+	int i;
 
-	/* Setup our allocation parameters */
-	pr_debug("%s: importing dma_buf %p/fd %d\n", __func__, dma_buf, fd);
+	for_each_sg(sgt->sgl, s, sgt->nents, i) {
+		if (sg_dma_address(s) != expected)
+			return 0;
+		size += sg_dma_len(s);
+		expected += sg_dma_len(s);
+	}
 
-	if (fd < 0)
-		get_dma_buf(dma_buf);
-	else
-		dma_buf = dma_buf_get(fd);
+	return size;
+}
 
-	if (!dma_buf)
-		return -EINVAL;
+/*
+ * Undo vc_sm_cma_import_prepare, and free the VPU handle if the import had got
+ * that far. Drops the reference on the source dma_buf.
+ */
+static void vc_sm_cma_import_abort(struct vc_sm_buffer *buffer, u32 res_handle)
+{
+	if (res_handle) {
+		struct vc_sm_free_t free = { res_handle, 0 };
+
+		vc_sm_cma_vchi_free(sm_state->sm_handle, &free,
+				    &sm_state->int_trans_id);
+	}
+	if (buffer->kernel_id > 0)
+		free_kernel_id(buffer->kernel_id);
+	if (buffer->import.sgt)
+		dma_buf_unmap_attachment(buffer->import.attach,
+					 buffer->import.sgt,
+					 DMA_BIDIRECTIONAL);
+	if (buffer->import.attach)
+		dma_buf_detach(buffer->import.dma_buf, buffer->import.attach);
+	dma_buf_put(buffer->import.dma_buf);
+	kfree(buffer);
+}
+
+/*
+ * First half of an import: map @dma_buf for the VPU and fill in the import
+ * request. Takes over the caller's reference on @dma_buf.
+ */
+static int vc_sm_cma_import_prepare(struct dma_buf *dma_buf,
+				    struct vc_sm_buffer **ret_buffer,
+				    struct vc_sm_import *import)
+{
+	struct vc_sm_buffer *buffer;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	dma_addr_t dma_addr;
+	size_t size;
+	int ret;
+
+	/* Allocate local buffer to track this allocation. */
+	buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
+	if (!buffer) {
+		dma_buf_put(dma_buf);
+		return -ENOMEM;
+	}
+	buffer->import.dma_buf = dma_buf;
 
 	attach = dma_buf_attach(dma_buf, &sm_state->pdev->dev);
 	if (IS_ERR(attach)) {
 		ret = PTR_ERR(attach);
 		goto error;
 	}
+	buffer->import.attach = attach;
 
 	sgt = dma_buf_map_attachment(attach, DMA_BIDIRECTIONAL);
 	if (IS_ERR(sgt)) {
 		ret = PTR_ERR(sgt);
 		goto error;
 	}
+	buffer->import.sgt = sgt;
 
 	/* Verify that the address block is contiguous */
-	if (sgt->nents != 1) {
-		ret = -ENOMEM;
-		goto error;
-	}
-
-	/* Allocate local buffer to track this allocation. */
-	buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
-	if (!buffer) {
+	size = vc_sm_sgt_contig_size(sgt);
+	if (!size) {
+		pr_err("%s: dma_buf %p is not contiguous (%u entries)\n",
+		       __func__, dma_buf, sgt->nents);
 		ret = -ENOMEM;
 		goto error;
 	}
 
-	import.type = VC_SM_ALLOC_NON_CACHED;
+	import->type = VC_SM_ALLOC_NON_CACHED;
 	dma_addr = sg_dma_address(sgt->sgl);
-	import.addr = (u32)dma_addr;
-	if ((import.addr & 0xC0000000) != 0xC0000000) {
-		pr_err("%s: Expecting an uncached alias for dma_addr %pad\n",
-		       __func__, &dma_addr);
-		import.addr |= 0xC0000000;
-	}
-	import.size = sg_dma_len(sgt->sgl);
-	import.allocator = current->tgid;
-	import.kernel_id = get_kernel_id(buffer);
+	ret = vc_sm_vpu_addr(dma_addr, size, &import->addr);
+	if (ret)
+		goto error;
+	import->size = size;
+	import->allocator = current->tgid;
+	import->kernel_id = get_kernel_id(buffer);
 
-	memcpy(import.name, VC_SM_RESOURCE_NAME_DEFAULT,
+	memcpy(import->name, VC_SM_RESOURCE_NAME_DEFAULT,
 	       sizeof(VC_SM_RESOURCE_NAME_DEFAULT));
 
+	buffer->kernel_id = import->kernel_id;
+	buffer->dma_addr = dma_addr;
+	buffer->size = size;
+
 	pr_debug("[%s]: attempt to import \"%s\" data - type %u, addr %pad, size %u.\n",
-		 __func__, import.name, import.type, &dma_addr, import.size);
+		 __func__, import->name, import->type, &dma_addr, import->size);
+
+	*ret_buffer = buffer;
+	return 0;
+
+error:
+	vc_sm_cma_import_abort(buffer, 0);
+	return ret;
+}
+
+/*
+ * Second half of an import: given the VPU's reply to the import request,
+ * export the new dma_buf. Releases everything if the import failed.
+ */
+static int vc_sm_cma_import_finish(struct vc_sm_privdata_t *private,
+				   struct vc_sm_buffer *buffer,
+				   struct vc_sm_import *import,
+				   struct vc_sm_import_result *result,
+				   int status, struct dma_buf **imported_buf)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	int ret;
 
-	/* Allocate the videocore buffer. */
-	status = vc_sm_cma_vchi_import(sm_state->sm_handle, &import, &result,
-				       &sm_state->int_trans_id);
 	if (status == -EINTR) {
 		pr_debug("[%s]: requesting import memory action restart (trans_id: %u)\n",
 			 __func__, sm_state->int_trans_id);
@@ -843,7 +1511,7 @@ vc_sm_cma_import_dmabuf_internal(struct vc_sm_privdata_t *private,
 		private->restart_sys = -EINTR;
 		private->int_action = VC_SM_MSG_TYPE_IMPORT;
 		goto error;
-	} else if (status || !result.res_handle) {
+	} else if (status || !result->res_handle) {
 		pr_debug("[%s]: failed to import memory on videocore (status: %u, trans_id: %u)\n",
 			 __func__, status, sm_state->int_trans_id);
 		ret = -ENOMEM;
@@ -852,23 +1520,18 @@ vc_sm_cma_import_dmabuf_internal(struct vc_sm_privdata_t *private,
 
 	mutex_init(&buffer->lock);
 	INIT_LIST_HEAD(&buffer->attachments);
-	memcpy(buffer->name, import.name,
-	       min(sizeof(buffer->name), sizeof(import.name) - 1));
+	INIT_LIST_HEAD(&buffer->cache_list);
+	memcpy(buffer->name, import->name,
+	       min(sizeof(buffer->name), sizeof(import->name) - 1));
 
 	/* Keep track of the buffer we created. */
 	buffer->private = private;
-	buffer->vc_handle = result.res_handle;
-	buffer->size = import.size;
+	buffer->pid = private->pid;
+	buffer->vc_handle = result->res_handle;
 	buffer->vpu_state = VPU_MAPPED;
 
 	buffer->imported = 1;
-	buffer->import.dma_buf = dma_buf;
-
-	buffer->import.attach = attach;
-	buffer->import.sgt = sgt;
-	buffer->dma_addr = dma_addr;
 	buffer->in_use = 1;
-	buffer->kernel_id = import.kernel_id;
 
 	/*
 	 * We're done - we need to export a new dmabuf chaining through most
@@ -876,7 +1539,7 @@ vc_sm_cma_import_dmabuf_internal(struct vc_sm_privdata_t *private,
 	 * here.
 	 */
 	exp_info.ops = &dma_buf_import_ops;
-	exp_info.size = import.size;
+	exp_info.size = import->size;
 	exp_info.flags = O_RDWR;
 	exp_info.priv = buffer;
 
@@ -893,20 +1556,44 @@ vc_sm_cma_import_dmabuf_internal(struct vc_sm_privdata_t *private,
 	return 0;
 
 error:
-	if (result.res_handle) {
-		struct vc_sm_free_t free = { result.res_handle, 0 };
+	vc_sm_cma_import_abort(buffer, result->res_handle);
+	return ret;
+}
+
+/* Import a dma_buf to be shared with VC. */
+int
+vc_sm_cma_import_dmabuf_internal(struct vc_sm_privdata_t *private,
+				 struct dma_buf *dma_buf,
+				 int fd,
+				 struct dma_buf **imported_buf)
+{
+	struct vc_sm_buffer *buffer;
+	struct vc_sm_import import = { };
+	struct vc_sm_import_result result = { };
+	int ret;
+	int status;
+
+	/* Setup our allocation parameters */
+	pr_debug("%s: importing dma_buf %p/fd %d\n", __func__, dma_buf, fd);
+
+	if (fd < 0)
+		get_dma_buf(dma_buf);
+	else
+		dma_buf = dma_buf_get(fd);
+
+	if (!dma_buf)
+		return -EINVAL;
+
+	ret = vc_sm_cma_import_prepare(dma_buf, &buffer, &import);
+	if (ret)
+		return ret;
+
+	/* Allocate the videocore buffer. */
+	status = vc_sm_cma_vchi_import(sm_state->sm_handle, &import, &result,
+				       &sm_state->int_trans_id);
 
-		vc_sm_cma_vchi_free(sm_state->sm_handle, &free,
-				    &sm_state->int_trans_id);
-	}
-	free_kernel_id(import.kernel_id);
-	kfree(buffer);
-	if (sgt)
-		dma_buf_unmap_attachment(attach, sgt, DMA_BIDIRECTIONAL);
-	if (attach)
-		dma_buf_detach(dma_buf, attach);
-	dma_buf_put(dma_buf);
-	return ret;
+	return vc_sm_cma_import_finish(private, buffer, &import, &result,
+				       status, imported_buf);
 }
 
 static int vc_sm_cma_vpu_alloc(u32 size, u32 align, const char *name,
@@ -916,6 +1603,7 @@ static int vc_sm_cma_vpu_alloc(u32 size, u32 align, const char *name,
 	struct vc_sm_buffer *buffer = NULL;
 	struct sg_table *sgt;
 	int aligned_size;
+	u32 vpu_addr;
 	int ret = 0;
 
 	/* Align to the user requested align */
@@ -950,6 +1638,10 @@ static int vc_sm_cma_vpu_alloc(u32 size, u32 align, const char *name,
 	pr_debug("[%s]: alloc of %d bytes success\n",
 		 __func__, aligned_size);
 
+	ret = vc_sm_vpu_addr(buffer->dma_addr, aligned_size, &vpu_addr);
+	if (ret)
+		goto error;
+
 	sgt = kmalloc(sizeof(*sgt), GFP_KERNEL);
 	if (!sgt) {
 		ret = -ENOMEM;
@@ -981,12 +1673,6 @@ static int vc_sm_cma_vpu_alloc(u32 size, u32 align, const char *name,
 		ret = PTR_ERR(buffer->dma_buf);
 		goto error;
 	}
-	buffer->dma_addr = (u32)sg_dma_address(buffer->alloc.sg_table->sgl);
-	if ((buffer->dma_addr & 0xC0000000) != 0xC0000000) {
-		pr_warn_once("%s: Expecting an uncached alias for dma_addr %pad\n",
-			     __func__, &buffer->dma_addr);
-		buffer->dma_addr |= 0xC0000000;
-	}
 	buffer->private = sm_state->vpu_allocs;
 
 	buffer->vc_handle = mem_handle;
@@ -1072,7 +1758,9 @@ vc_sm_vpu_event(struct sm_instance *instance, struct vc_sm_result_t *reply,
 
 		reply.trans_id = req->trans_id;
 		if (!ret) {
-			reply.addr = buffer->dma_addr;
+			/* Checked against the VPU window by the allocation */
+			vc_sm_vpu_addr(buffer->dma_addr, buffer->size,
+				       &reply.addr);
 			reply.kernel_id = buffer->kernel_id;
 			pr_debug("%s: Allocated resource buffer %p, addr %pad\n",
 				 __func__, buffer, &buffer->dma_addr);
@@ -1136,16 +1824,102 @@ static int vc_sm_cma_release(struct inode *inode, struct file *file)
 
 	pr_debug("[%s]: using private data %p\n", __func__, file_data);
 
-	/* Terminate the private data. */
-	kfree(file_data);
+	/* Terminate the private data, once any charged buffers are freed. */
+	kref_put(&file_data->ref, vc_sm_cma_free_priv_data);
 
 out:
 	return ret;
 }
 
+/*
+ * Clears a pooled allocation before it is handed to a new owner, as a fresh
+ * one from CMA would be. Cached allocations have no kernel mapping, so are
+ * cleared page by page and then cleaned out to memory for the VPU.
+ */
+static void vc_sm_pool_clear(struct vc_sm_buffer *buffer)
+{
+	struct sg_table *sgt = buffer->alloc.sg_table;
+	struct sg_page_iter piter;
+
+	if (!buffer->cached) {
+		memset(buffer->cookie, 0, buffer->size);
+		return;
+	}
+
+	for_each_sg_page(sgt->sgl, &piter, sgt->orig_nents, 0)
+		clear_highpage(sg_page_iter_page(&piter));
+	dma_sync_sg_for_device(&sm_state->pdev->dev, sgt->sgl, sgt->orig_nents,
+			       DMA_TO_DEVICE);
+}
+
+/*
+ * Hand out a pooled allocation, which is already imported into the VPU
+ * mappings, as a new dmabuf.
+ */
+static int vc_sm_cma_alloc_pooled(struct vc_sm_privdata_t *private,
+				  struct vc_sm_cma_ioctl_alloc *ioparam,
+				  struct vc_sm_buffer *buffer)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct dma_buf *dmabuf;
+	int fd;
+
+	vc_sm_pool_clear(buffer);
+
+	memset(buffer->name, 0, sizeof(buffer->name));
+	if (*ioparam->name)
+		memcpy(buffer->name, ioparam->name, sizeof(buffer->name) - 1);
+	else
+		memcpy(buffer->name, VC_SM_RESOURCE_NAME_DEFAULT,
+		       sizeof(VC_SM_RESOURCE_NAME_DEFAULT));
+	buffer->private = private;
+	buffer->pid = private->pid;
+	buffer->charged = 1;
+
+	exp_info.ops = &dma_buf_ops;
+	exp_info.size = buffer->size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = buffer;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		/* Put it straight back, still imported. */
+		buffer->charged = 0;
+		vc_sm_uncharge(private, buffer->size);
+		mutex_lock(&buffer->lock);
+		vc_sm_add_resource(private, buffer);
+		if (!vc_sm_pool_put(buffer)) {
+			vc_sm_vpu_free(buffer);
+			vc_sm_release_resource(buffer);
+		} else {
+			mutex_unlock(&buffer->lock);
+		}
+		return PTR_ERR(dmabuf);
+	}
+	buffer->dma_buf = dmabuf;
+
+	vc_sm_add_resource(private, buffer);
+
+	fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (fd < 0) {
+		/* The release returns the buffer to the pool */
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+
+	pr_debug("[%s]: Reused pooled buffer %p as fd %d, private %p, dma_addr %pad\n",
+		 __func__, buffer, fd, private, &buffer->dma_addr);
+
+	ioparam->handle = fd;
+	ioparam->vc_handle = buffer->vc_handle;
+	ioparam->dma_addr = buffer->dma_addr;
+	return 0;
+}
+
 /*
  * Allocate a shared memory handle and block.
- * Allocation is from CMA, and then imported into the VPU mappings.
+ * The size is charged to @private first. Allocation is then from the pool if
+ * possible, otherwise from CMA and then imported into the VPU mappings.
  */
 int vc_sm_cma_ioctl_alloc(struct vc_sm_privdata_t *private,
 			  struct vc_sm_cma_ioctl_alloc *ioparam)
@@ -1156,16 +1930,26 @@ int vc_sm_cma_ioctl_alloc(struct vc_sm_privdata_t *private,
 	struct vc_sm_import_result result = { 0 };
 	struct dma_buf *dmabuf = NULL;
 	struct sg_table *sgt;
+	bool cached = ioparam->cached == VC_SM_CMA_CACHE_HOST ||
+		      ioparam->cached == VC_SM_CMA_CACHE_BOTH;
 	int aligned_size;
 	int ret = 0;
 	int status;
 	int fd = -1;
 
-	aligned_size = PAGE_ALIGN(ioparam->size);
+	aligned_size = vc_sm_pool_class_size(PAGE_ALIGN(ioparam->size));
 
 	if (!aligned_size)
 		return -EINVAL;
 
+	ret = vc_sm_charge(private, aligned_size);
+	if (ret)
+		return ret;
+
+	buffer = vc_sm_pool_get(aligned_size, cached);
+	if (buffer)
+		return vc_sm_cma_alloc_pooled(private, ioparam, buffer);
+
 	/* Allocate local buffer to track this allocation. */
 	buffer = kzalloc(sizeof(*buffer), GFP_KERNEL);
 	if (!buffer) {
@@ -1173,13 +1957,38 @@ int vc_sm_cma_ioctl_alloc(struct vc_sm_privdata_t *private,
 		goto error;
 	}
 
-	buffer->cookie = dma_alloc_coherent(&sm_state->pdev->dev,
-					    aligned_size,
-					    &buffer->dma_addr,
-					    GFP_KERNEL);
+	/* The charge moves to the buffer, and is dropped on its release. */
+	buffer->private = private;
+	buffer->pid = private->pid;
+	buffer->charged = 1;
+
+	/*
+	 * Host-cached allocations are mapped write-back to userspace, with
+	 * coherency handled through the dma_buf CPU access hooks and the
+	 * cache maintenance ioctl. The VPU always uses the uncached alias.
+	 */
+	buffer->cached = cached;
+	buffer->size = aligned_size;
+	buffer->cookie = dma_alloc_attrs(&sm_state->pdev->dev,
+					 aligned_size,
+					 &buffer->dma_addr,
+					 GFP_KERNEL,
+					 vc_sm_alloc_attrs(buffer));
+	/*
+	 * A failing CMA allocation doesn't run the shrinkers, so give back
+	 * the pool's idle buffers and retry once. Buffers the VPU has yet to
+	 * release are only freed once it has, so this can still fail.
+	 */
+	if (!buffer->cookie && vc_sm_pool_drain())
+		buffer->cookie = dma_alloc_attrs(&sm_state->pdev->dev,
+						 aligned_size,
+						 &buffer->dma_addr,
+						 GFP_KERNEL,
+						 vc_sm_alloc_attrs(buffer));
 	if (!buffer->cookie) {
-		pr_err("[%s]: dma_alloc_coherent alloc of %d bytes failed\n",
+		pr_err("[%s]: dma_alloc_attrs alloc of %d bytes failed\n",
 		       __func__, aligned_size);
+		vc_sm_global_pressure();
 		ret = -ENOMEM;
 		goto error;
 	}
@@ -1206,11 +2015,14 @@ int vc_sm_cma_ioctl_alloc(struct vc_sm_privdata_t *private,
 	dmabuf = dma_buf_export(&exp_info);
 	if (IS_ERR(dmabuf)) {
 		ret = PTR_ERR(dmabuf);
+		dmabuf = NULL;
 		goto error;
 	}
 	buffer->dma_buf = dmabuf;
 
-	import.addr = buffer->dma_addr;
+	ret = vc_sm_vpu_addr(buffer->dma_addr, aligned_size, &import.addr);
+	if (ret)
+		goto error;
 	import.size = aligned_size;
 	import.kernel_id = get_kernel_id(buffer);
 
@@ -1232,7 +2044,6 @@ int vc_sm_cma_ioctl_alloc(struct vc_sm_privdata_t *private,
 	}
 
 	/* Keep track of the buffer we created. */
-	buffer->private = private;
 	buffer->vc_handle = result.res_handle;
 	buffer->size = import.size;
 	buffer->vpu_state = VPU_MAPPED;
@@ -1244,8 +2055,9 @@ int vc_sm_cma_ioctl_alloc(struct vc_sm_privdata_t *private,
 		goto error;
 	}
 
-	ret = dma_get_sgtable(&sm_state->pdev->dev, sgt, buffer->cookie,
-			      buffer->dma_addr, buffer->size);
+	ret = dma_get_sgtable_attrs(&sm_state->pdev->dev, sgt, buffer->cookie,
+				    buffer->dma_addr, buffer->size,
+				    vc_sm_alloc_attrs(buffer));
 	if (ret < 0) {
 		/* FIXME: error handling */
 		pr_err("failed to get scatterlist from DMA API\n");
@@ -1253,6 +2065,20 @@ int vc_sm_cma_ioctl_alloc(struct vc_sm_privdata_t *private,
 		ret = -ENOMEM;
 		goto error;
 	}
+
+	/*
+	 * Cached buffers are synced through the table, which needs it mapped.
+	 * The memory is already clean from the allocation, so skip the sync.
+	 */
+	if (buffer->cached &&
+	    !dma_map_sg_attrs(&sm_state->pdev->dev, sgt->sgl, sgt->orig_nents,
+			      DMA_BIDIRECTIONAL, DMA_ATTR_SKIP_CPU_SYNC)) {
+		pr_err("failed to map scatterlist\n");
+		sg_free_table(sgt);
+		kfree(sgt);
+		ret = -ENOMEM;
+		goto error;
+	}
 	buffer->alloc.sg_table = sgt;
 
 	fd = dma_buf_fd(dmabuf, O_CLOEXEC);
@@ -1280,10 +2106,12 @@ error:
 		dma_buf_put(dmabuf);
 	} else {
 		/* No dmabuf, therefore just free the buffer here */
-		if (buffer->cookie)
-			dma_free_coherent(&sm_state->pdev->dev, buffer->size,
-					  buffer->cookie, buffer->dma_addr);
+		if (buffer && buffer->cookie)
+			dma_free_attrs(&sm_state->pdev->dev, buffer->size,
+				       buffer->cookie, buffer->dma_addr,
+				       vc_sm_alloc_attrs(buffer));
 		kfree(buffer);
+		vc_sm_uncharge(private, aligned_size);
 	}
 	return ret;
 }
@@ -1314,6 +2142,7 @@ static void (*cache_op_to_func(const unsigned int cache_op))
 
 /*
  * Clean/invalid/flush cache of which buffer is already pinned (i.e. accessed).
+ * Rows that touch or overlap are handled as a single range.
  */
 static int clean_invalid_contig_2d(const void __user *addr,
 				   const size_t block_count,
@@ -1324,25 +2153,105 @@ static int clean_invalid_contig_2d(const void __user *addr,
 	size_t i;
 	void (*op_fn)(const void *start, const void *end);
 
-	if (!block_size) {
-		pr_err("[%s]: size cannot be 0\n", __func__);
-		return -EINVAL;
-	}
-
 	op_fn = cache_op_to_func(cache_op);
 	if (!op_fn)
 		return -EINVAL;
 
+	if (stride <= block_size) {
+		op_fn(addr, addr + (block_count - 1) * stride + block_size);
+		return 0;
+	}
+
 	for (i = 0; i < block_count; i ++, addr += stride)
 		op_fn(addr, addr + block_size);
 
 	return 0;
 }
+#else
+/* Performs a VCSM_CACHE_OP_* on a range of a buffer through the DMA API. */
+static int vc_sm_cache_op_sync(dma_addr_t dma_addr, size_t size,
+			       const unsigned int cache_op)
+{
+	struct device *dev = &sm_state->pdev->dev;
+
+	switch (cache_op) {
+	case VC_SM_CACHE_OP_INV:
+		dma_sync_single_for_cpu(dev, dma_addr, size, DMA_FROM_DEVICE);
+		break;
+
+	case VC_SM_CACHE_OP_CLEAN:
+		dma_sync_single_for_device(dev, dma_addr, size, DMA_TO_DEVICE);
+		break;
+
+	case VC_SM_CACHE_OP_FLUSH:
+		dma_sync_single_for_device(dev, dma_addr, size,
+					   DMA_BIDIRECTIONAL);
+		dma_sync_single_for_cpu(dev, dma_addr, size,
+					DMA_BIDIRECTIONAL);
+		break;
+
+	default:
+		pr_err("[%s]: Invalid cache_op: 0x%08x\n", __func__, cache_op);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Clean/invalid/flush cache of a region of one of our own allocations mapped
+ * into userspace. The DMA API needs the bus address, so look up the buffer
+ * from the mapping. Rows that touch or overlap are handled as a single range.
+ */
+static int clean_invalid_contig_2d(const void __user *addr,
+				   const size_t block_count,
+				   const size_t block_size,
+				   const size_t stride,
+				   const unsigned int cache_op)
+{
+	unsigned long start = (unsigned long)addr;
+	unsigned long end = start + (block_count - 1) * stride + block_size;
+	struct vm_area_struct *vma;
+	struct vc_sm_buffer *buf;
+	dma_addr_t dma_addr;
+	size_t i;
+	int ret = 0;
+
+	down_read(&current->mm->mmap_sem);
+	vma = find_vma(current->mm, start);
+	if (!vma || start < vma->vm_start || end > vma->vm_end ||
+	    vma->vm_ops != &vc_sm_vm_ops) {
+		pr_err("[%s]: %p is not a vcsm-cma mapping\n", __func__, addr);
+		ret = -EINVAL;
+		goto out;
+	}
+	buf = vma->vm_private_data;
+	if (!buf->cached)
+		/* Coherent allocations need no maintenance. */
+		goto out;
+	dma_addr = buf->dma_addr + (start - vma->vm_start);
+
+	if (stride <= block_size) {
+		ret = vc_sm_cache_op_sync(dma_addr, end - start, cache_op);
+		goto out;
+	}
+
+	for (i = 0; i < block_count && !ret; i++, dma_addr += stride)
+		ret = vc_sm_cache_op_sync(dma_addr, block_size, cache_op);
+
+out:
+	up_read(&current->mm->mmap_sem);
+	return ret;
+}
+#endif
 
 static int vc_sm_cma_clean_invalid2(unsigned int cmdnr, unsigned long arg)
 {
 	struct vc_sm_cma_ioctl_clean_invalid2 ioparam;
 	struct vc_sm_cma_ioctl_clean_invalid_block *block = NULL;
+#if !defined(CONFIG_ARM64) && !defined(CONFIG_SMP)
+	size_t bytes, total = 0;
+#endif
 	int i, ret = 0;
 
 	/* Get parameter data. */
@@ -1363,6 +2272,45 @@ static int vc_sm_cma_clean_invalid2(unsigned int cmdnr, unsigned long arg)
 		goto out;
 	}
 
+	for (i = 0; i < ioparam.op_count; i++) {
+		const struct vc_sm_cma_ioctl_clean_invalid_block * const op =
+								block + i;
+
+		if (op->invalidate_mode == VC_SM_CACHE_OP_NOP)
+			continue;
+
+		if (!op->block_size || !op->block_count) {
+			pr_err("[%s]: size cannot be 0\n", __func__);
+			ret = -EINVAL;
+			goto out;
+		}
+		if (op->block_count - 1 >
+		    (SIZE_MAX - op->block_size) / max_t(size_t, 1,
+						op->inter_block_stride)) {
+			pr_err("[%s]: block %d wraps\n", __func__, i);
+			ret = -EINVAL;
+			goto out;
+		}
+#if !defined(CONFIG_ARM64) && !defined(CONFIG_SMP)
+		if (check_mul_overflow((size_t)op->block_count,
+				       (size_t)op->block_size, &bytes) ||
+		    check_add_overflow(total, bytes, &total))
+			total = SIZE_MAX;
+#endif
+	}
+
+#if !defined(CONFIG_ARM64) && !defined(CONFIG_SMP)
+	/*
+	 * Above the threshold it is cheaper to flush the whole data cache than
+	 * to walk every line. A flush also satisfies clean and invalidate
+	 * requests.
+	 */
+	if (cache_flush_all_threshold && total >= cache_flush_all_threshold) {
+		flush_cache_all();
+		goto out;
+	}
+#endif
+
 	for (i = 0; i < ioparam.op_count; i++) {
 		const struct vc_sm_cma_ioctl_clean_invalid_block * const op =
 								block + i;
@@ -1382,7 +2330,46 @@ out:
 
 	return ret;
 }
-#endif
+
+static __poll_t vc_sm_cma_poll(struct file *file, poll_table *wait)
+{
+	struct vc_sm_privdata_t *file_data =
+	    (struct vc_sm_privdata_t *)file->private_data;
+
+	if (!sm_state || !file_data)
+		return EPOLLERR;
+
+	poll_wait(file, &sm_state->pressure_wq, wait);
+
+	return vc_sm_pressure_pending(file_data) ? EPOLLPRI : 0;
+}
+
+/*
+ * Returns, as a u32, the number of pressure notifications since the last
+ * read, and clears them.
+ */
+static ssize_t vc_sm_cma_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct vc_sm_privdata_t *file_data =
+	    (struct vc_sm_privdata_t *)file->private_data;
+	u32 events;
+	int seq;
+
+	if (!sm_state || !file_data)
+		return -EPERM;
+	if (count < sizeof(events))
+		return -EINVAL;
+
+	seq = atomic_read(&sm_state->pressure_seq);
+	events = atomic_xchg(&file_data->pressure, 0) +
+		 (seq - xchg(&file_data->pressure_seen, seq));
+
+	if (copy_to_user(buf, &events, sizeof(events)))
+		return -EFAULT;
+
+	return sizeof(events);
+}
 
 static long vc_sm_cma_ioctl(struct file *file, unsigned int cmd,
 			    unsigned long arg)
@@ -1480,7 +2467,6 @@ static long vc_sm_cma_ioctl(struct file *file, unsigned int cmd,
 		break;
 	}
 
-#ifndef CONFIG_ARM64
 	/*
 	 * Flush/Invalidate the cache for a given mapping.
 	 * Blocks must be pinned (i.e. accessed) before this call.
@@ -1488,7 +2474,6 @@ static long vc_sm_cma_ioctl(struct file *file, unsigned int cmd,
 	case VC_SM_CMA_CMD_CLEAN_INVALID2:
 		ret = vc_sm_cma_clean_invalid2(cmdnr, arg);
 		break;
-#endif
 
 	default:
 		pr_debug("[%s]: cmd %x tgid %u, owner %u\n", __func__, cmdnr,
@@ -1540,6 +2525,8 @@ static const struct file_operations vc_sm_ops = {
 #endif
 	.open = vc_sm_cma_open,
 	.release = vc_sm_cma_release,
+	.read = vc_sm_cma_read,
+	.poll = vc_sm_cma_poll,
 };
 
 /* Driver load/unload functions */
@@ -1592,7 +2579,13 @@ static void vc_sm_connected_init(void)
 				    &sm_state->dir_state,
 				    &vc_sm_cma_debug_fs_fops);
 
-	INIT_LIST_HEAD(&sm_state->buffer_list);
+	sm_state->pool_shrinker.count_objects = vc_sm_pool_shrink_count;
+	sm_state->pool_shrinker.scan_objects = vc_sm_pool_shrink_scan;
+	sm_state->pool_shrinker.seeks = DEFAULT_SEEKS;
+	ret = register_shrinker(&sm_state->pool_shrinker);
+	if (ret)
+		pr_warn("[%s]: failed to register pool shrinker %d\n",
+			__func__, ret);
 
 	/* Create a shared memory device. */
 	sm_state->misc_dev.minor = MISC_DYNAMIC_MINOR;
@@ -1614,6 +2607,13 @@ static void vc_sm_connected_init(void)
 		goto err_remove_misc_dev;
 	}
 
+	sm_state->vpu_allocs = vc_sm_cma_create_priv_data(0);
+	if (!sm_state->vpu_allocs) {
+		pr_err("[%s]: failed to create VPU allocation tracker\n",
+		       __func__);
+		goto err_remove_misc_dev;
+	}
+
 	version.version = 2;
 	ret = vc_sm_cma_vchi_client_version(sm_state->sm_handle, &version,
 					    &version_result,
@@ -1631,6 +2631,7 @@ static void vc_sm_connected_init(void)
 err_remove_misc_dev:
 	misc_deregister(&sm_state->misc_dev);
 err_remove_debugfs:
+	unregister_shrinker(&sm_state->pool_shrinker);
 	debugfs_remove_recursive(sm_state->dir_root);
 	vc_sm_cma_vchi_stop(&sm_state->sm_handle);
 }
@@ -1644,7 +2645,16 @@ static int bcm2835_vc_sm_cma_probe(struct platform_device *pdev)
 	if (!sm_state)
 		return -ENOMEM;
 	sm_state->pdev = pdev;
-	mutex_init(&sm_state->map_lock);
+	mutex_init(&sm_state->import_cache_lock);
+	INIT_LIST_HEAD(&sm_state->import_cache);
+	mutex_init(&sm_state->pool_lock);
+	INIT_LIST_HEAD(&sm_state->pool);
+	INIT_LIST_HEAD(&sm_state->pool_evict);
+	INIT_WORK(&sm_state->pool_evict_work, vc_sm_pool_evict_work);
+	mutex_init(&sm_state->privdata_lock);
+	INIT_LIST_HEAD(&sm_state->privdata_list);
+	atomic_set(&sm_state->pressure_seq, 0);
+	init_waitqueue_head(&sm_state->pressure_wq);
 
 	spin_lock_init(&sm_state->kernelid_map_lock);
 	idr_init_base(&sm_state->kernelid_map, 1);
@@ -1664,8 +2674,20 @@ static int bcm2835_vc_sm_cma_remove(struct platform_device *pdev)
 {
 	pr_debug("[%s]: start\n", __func__);
 	if (sm_inited) {
+		LIST_HEAD(evict);
+
 		misc_deregister(&sm_state->misc_dev);
 
+		/* Drop everything still parked in the import cache. */
+		mutex_lock(&sm_state->import_cache_lock);
+		vc_sm_import_cache_trim(&evict, 0);
+		mutex_unlock(&sm_state->import_cache_lock);
+		vc_sm_import_cache_release(&evict);
+
+		/* And the allocation pool. */
+		unregister_shrinker(&sm_state->pool_shrinker);
+		vc_sm_pool_drain();
+
 		/* Remove all proc entries. */
 		debugfs_remove_recursive(sm_state->dir_root);
 
@@ -1677,7 +2699,9 @@ static int bcm2835_vc_sm_cma_remove(struct platform_device *pdev)
 		idr_destroy(&sm_state->kernelid_map);
 
 		/* Free the memory for the state structure. */
-		mutex_destroy(&sm_state->map_lock);
+		mutex_destroy(&sm_state->privdata_lock);
+		mutex_destroy(&sm_state->pool_lock);
+		mutex_destroy(&sm_state->import_cache_lock);
 	}
 
 	pr_debug("[%s]: end\n", __func__);
@@ -1706,6 +2730,8 @@ EXPORT_SYMBOL_GPL(vc_sm_cma_int_handle);
 int vc_sm_cma_free(void *handle)
 {
 	struct dma_buf *dma_buf = (struct dma_buf *)handle;
+	struct vc_sm_buffer *buf;
+	LIST_HEAD(evict);
 
 	/* Validate we can work with this device. */
 	if (!sm_state || !handle) {
@@ -1715,12 +2741,60 @@ int vc_sm_cma_free(void *handle)
 
 	pr_debug("%s: handle %p/dmabuf %p\n", __func__, handle, dma_buf);
 
+	/*
+	 * If this is the last reference on a kernel import, park it in the
+	 * import cache rather than unmapping it from the VPU.
+	 */
+	buf = (struct vc_sm_buffer *)dma_buf->priv;
+	if (import_cache_size && buf->imported &&
+	    buf->private == sm_state->data_knl &&
+	    buf->vpu_state == VPU_MAPPED && file_count(dma_buf->file) == 1) {
+		mutex_lock(&sm_state->import_cache_lock);
+		list_add(&buf->cache_list, &sm_state->import_cache);
+		sm_state->import_cache_count++;
+		vc_sm_import_cache_trim(&evict, import_cache_size);
+		mutex_unlock(&sm_state->import_cache_lock);
+
+		vc_sm_import_cache_release(&evict);
+		return 0;
+	}
+
 	dma_buf_put(dma_buf);
 
 	return 0;
 }
 EXPORT_SYMBOL_GPL(vc_sm_cma_free);
 
+/*
+ * Release any cached import of @src_dmabuf, along with any import the cache
+ * now holds the last reference to. @src_dmabuf may be NULL to only do the
+ * latter.
+ */
+void vc_sm_cma_import_cache_drop(struct dma_buf *src_dmabuf)
+{
+	struct vc_sm_buffer *buffer, *tmp;
+	LIST_HEAD(evict);
+
+	if (!sm_state)
+		return;
+
+	mutex_lock(&sm_state->import_cache_lock);
+	list_for_each_entry_safe(buffer, tmp, &sm_state->import_cache,
+				 cache_list) {
+		if (buffer->import.dma_buf != src_dmabuf)
+			continue;
+
+		list_move(&buffer->cache_list, &evict);
+		sm_state->import_cache_count--;
+		sm_state->import_cache_evictions++;
+	}
+	vc_sm_import_cache_trim(&evict, import_cache_size);
+	mutex_unlock(&sm_state->import_cache_lock);
+
+	vc_sm_import_cache_release(&evict);
+}
+EXPORT_SYMBOL_GPL(vc_sm_cma_import_cache_drop);
+
 /* Import a dmabuf to be shared with VC. */
 int vc_sm_cma_import_dmabuf(struct dma_buf *src_dmabuf, void **handle)
 {
@@ -1734,6 +2808,14 @@ int vc_sm_cma_import_dmabuf(struct dma_buf *src_dmabuf, void **handle)
 		return -EPERM;
 	}
 
+	buf = vc_sm_import_cache_lookup(src_dmabuf);
+	if (buf) {
+		pr_debug("%s: cache hit on dmabuf %p, ptr %p\n", __func__,
+			 src_dmabuf, buf->dma_buf);
+		*handle = buf->dma_buf;
+		return 0;
+	}
+
 	ret = vc_sm_cma_import_dmabuf_internal(sm_state->data_knl, src_dmabuf,
 					       -1, &new_dma_buf);
 
@@ -1757,6 +2839,111 @@ int vc_sm_cma_import_dmabuf(struct dma_buf *src_dmabuf, void **handle)
 }
 EXPORT_SYMBOL_GPL(vc_sm_cma_import_dmabuf);
 
+/*
+ * Import a set of dmabufs to be shared with VC.
+ * The requests are sent to the VPU back to back rather than waiting for each
+ * reply in turn. Either all the imports succeed and @handles is filled in, or
+ * all are released again and an error returned.
+ */
+int vc_sm_cma_import_dmabufs(struct dma_buf **src_dmabufs, void **handles,
+			     unsigned int count)
+{
+	struct vc_sm_buffer **buffers;
+	struct vc_sm_import *imports;
+	struct vc_sm_import_result *results;
+	int *status;
+	unsigned int i, n = 0;
+	int ret = 0;
+
+	/* Validate we can work with this device. */
+	if (!sm_state || !src_dmabufs || !handles) {
+		pr_err("[%s]: invalid input\n", __func__);
+		return -EPERM;
+	}
+
+	buffers = kcalloc(count, sizeof(*buffers), GFP_KERNEL);
+	imports = kcalloc(count, sizeof(*imports), GFP_KERNEL);
+	results = kcalloc(count, sizeof(*results), GFP_KERNEL);
+	status = kcalloc(count, sizeof(*status), GFP_KERNEL);
+	if (!buffers || !imports || !results || !status) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * Serve what we can from the import cache, and prepare the rest.
+	 * Prepared imports are packed at the start of the arrays, with
+	 * handles[i] left NULL for each of them.
+	 */
+	for (i = 0; i < count; i++) {
+		struct vc_sm_buffer *buf;
+
+		handles[i] = NULL;
+		if (ret)
+			continue;
+
+		buf = vc_sm_import_cache_lookup(src_dmabufs[i]);
+		if (buf) {
+			handles[i] = buf->dma_buf;
+			continue;
+		}
+
+		get_dma_buf(src_dmabufs[i]);
+		ret = vc_sm_cma_import_prepare(src_dmabufs[i], &buffers[n],
+					       &imports[n]);
+		if (!ret)
+			n++;
+	}
+
+	if (ret) {
+		for (i = 0; i < n; i++)
+			vc_sm_cma_import_abort(buffers[i], 0);
+		goto release;
+	}
+
+	vc_sm_cma_vchi_import_batch(sm_state->sm_handle, imports, results,
+				    status, n, &sm_state->int_trans_id);
+
+	/* Finish every import so that each releases its resources on error */
+	n = 0;
+	for (i = 0; i < count; i++) {
+		struct dma_buf *new_dma_buf;
+		int err;
+
+		if (handles[i])
+			continue;
+
+		err = vc_sm_cma_import_finish(sm_state->data_knl, buffers[n],
+					      &imports[n], &results[n],
+					      status[n], &new_dma_buf);
+		n++;
+		if (err) {
+			pr_err("%s: import of dmabuf %p failed %d\n",
+			       __func__, src_dmabufs[i], err);
+			if (!ret)
+				ret = err;
+			continue;
+		}
+		handles[i] = new_dma_buf;
+	}
+
+release:
+	if (ret) {
+		for (i = 0; i < count; i++) {
+			if (handles[i])
+				vc_sm_cma_free(handles[i]);
+			handles[i] = NULL;
+		}
+	}
+out:
+	kfree(status);
+	kfree(results);
+	kfree(imports);
+	kfree(buffers);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(vc_sm_cma_import_dmabufs);
+
 static struct platform_driver bcm2835_vcsm_cma_driver = {
 	.probe = bcm2835_vc_sm_cma_probe,
 	.remove = bcm2835_vc_sm_cma_remove,
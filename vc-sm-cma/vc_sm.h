@@ -42,7 +42,9 @@ struct vc_sm_imported {
 };
 
 struct vc_sm_buffer {
-	struct list_head global_buffer_list;	/* Global list of buffers. */
+	struct list_head list;		/* Entry on the owner's list or the pool */
+	struct vc_sm_privdata_t *owner;	/* Private data listing this buffer */
+	struct list_head cache_list;	/* Entry in the import cache. */
 
 	/* Index in the kernel_id idr so that we can find the
 	 * mmal_msg_context again when servicing the VCHI reply.
@@ -59,6 +61,8 @@ struct vc_sm_buffer {
 
 	int in_use:1;	/* Kernel is still using this resource */
 	int imported:1;	/* Imported dmabuf */
+	int cached:1;	/* Allocation is mapped cached on the host */
+	int charged:1;	/* Size is charged to the private data */
 
 	enum vc_sm_vpu_mapping_state vpu_state;
 	u32 vc_handle;	/* VideoCore handle for this buffer */
@@ -74,6 +78,7 @@ struct vc_sm_buffer {
 	void *cookie;
 
 	struct vc_sm_privdata_t *private;
+	pid_t pid;	/* Process the buffer is accounted to */
 
 	union {
 		struct vc_sm_alloc_data alloc;
@@ -18,6 +18,7 @@
 #include <linux/semaphore.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/xarray.h>
 
 #include "vc_sm_cma_vchi.h"
 
@@ -29,6 +30,12 @@
 /* Command blocks come from a pool */
 #define SM_MAX_NUM_CMD_RSP_BLKS 32
 
+/*
+ * Maximum number of batched imports in flight at once. Keep some of the pool
+ * free for other users, as the blocks are held until the replies are read.
+ */
+#define SM_IMPORT_BATCH_SIZE (SM_MAX_NUM_CMD_RSP_BLKS / 2)
+
 struct sm_cmd_rsp_blk {
 	struct list_head head;	/* To create lists */
 	/* To be signaled when the response is there */
@@ -36,12 +43,14 @@ struct sm_cmd_rsp_blk {
 
 	u32 id;
 	u16 length;
+	int error;	/* Set if the command failed without a usable reply */
 
 	u8 msg[VC_SM_MAX_MSG_LEN];
 
 	uint32_t wait:1;
 	uint32_t sent:1;
 	uint32_t alloc:1;
+	uint32_t dead:1;	/* Waiter was interrupted; free on reply */
 
 };
 
@@ -53,12 +62,12 @@ struct sm_instance {
 
 	vpu_event_cb vpu_event;
 
-	/* Mutex over the following lists */
+	/* Mutex over the following list and map, and the dead flags */
 	struct mutex lock;
 	u32 trans_id;
 	struct list_head cmd_list;
-	struct list_head rsp_list;
-	struct list_head dead_list;
+	/* Commands sent and awaiting a reply, indexed by trans_id */
+	struct xarray rsp_map;
 
 	struct sm_cmd_rsp_blk free_blk[SM_MAX_NUM_CMD_RSP_BLKS];
 
@@ -107,9 +116,12 @@ sm_cmd_rsp_blk *vc_vchi_cmd_create(struct sm_instance *instance,
 				     struct sm_cmd_rsp_blk, head);
 		list_del(&blk->head);
 		mutex_unlock(&instance->free_lock);
+		reinit_completion(&blk->cmplt);
 	}
 
 	blk->sent = 0;
+	blk->dead = 0;
+	blk->error = 0;
 	blk->wait = wait;
 	blk->length = sizeof(*hdr) + size;
 
@@ -145,40 +157,65 @@ vc_vchi_cmd_delete(struct sm_instance *instance, struct sm_cmd_rsp_blk *blk)
 	up(&instance->free_sema);
 }
 
+/*
+ * Takes a sent command out of the response map. Returns NULL if there is no
+ * such command, or if the waiter had given up on it in which case it is freed.
+ */
+static struct sm_cmd_rsp_blk *
+vc_sm_cma_vchi_rsp_take(struct sm_instance *instance, u32 trans_id)
+{
+	struct sm_cmd_rsp_blk *cmd;
+	bool dead;
+
+	mutex_lock(&instance->lock);
+	cmd = xa_erase(&instance->rsp_map, trans_id);
+	dead = cmd && cmd->dead;
+	mutex_unlock(&instance->lock);
+
+	if (dead) {
+		pr_debug("%s: reaped interrupted command %u", __func__,
+			 trans_id);
+		vc_vchi_cmd_delete(instance, cmd);
+		return NULL;
+	}
+
+	return cmd;
+}
+
 static void vc_sm_cma_vchi_rx_ack(struct sm_instance *instance,
-				  struct sm_cmd_rsp_blk *cmd,
 				  struct vc_sm_result_t *reply,
 				  u32 reply_len)
 {
-	mutex_lock(&instance->lock);
-	list_for_each_entry(cmd,
-			    &instance->rsp_list,
-			    head) {
-		if (cmd->id == reply->trans_id)
-			break;
-	}
-	mutex_unlock(&instance->lock);
+	struct sm_cmd_rsp_blk *cmd;
 
-	if (&cmd->head == &instance->rsp_list) {
-		//pr_debug("%s: received response %u, throw away...",
+	if (!xa_load(&instance->rsp_map, reply->trans_id)) {
 		pr_err("%s: received response %u, throw away...",
 		       __func__,
 		       reply->trans_id);
-	} else if (reply_len > sizeof(cmd->msg)) {
+		return;
+	}
+
+	cmd = vc_sm_cma_vchi_rsp_take(instance, reply->trans_id);
+	if (!cmd)
+		return;
+
+	if (reply_len > sizeof(cmd->msg)) {
 		pr_err("%s: reply too big (%u) %u, throw away...",
 		       __func__, reply_len,
 		     reply->trans_id);
+		/* Fail the waiter rather than leaving it blocked forever */
+		cmd->error = -EIO;
 	} else {
 		memcpy(cmd->msg, reply,
 		       reply_len);
-		complete(&cmd->cmplt);
 	}
+	complete(&cmd->cmplt);
 }
 
 static int vc_sm_cma_vchi_videocore_io(void *arg)
 {
 	struct sm_instance *instance = arg;
-	struct sm_cmd_rsp_blk *cmd = NULL, *cmd_tmp;
+	struct sm_cmd_rsp_blk *cmd;
 	struct vc_sm_result_t *reply;
 	u32 reply_len;
 	s32 status;
@@ -197,7 +234,7 @@ static int vc_sm_cma_vchi_videocore_io(void *arg)
 
 		do {
 			/*
-			 * Get new command and move it to response list
+			 * Get new command and move it to response map
 			 */
 			mutex_lock(&instance->lock);
 			if (list_empty(&instance->cmd_list)) {
@@ -207,10 +244,24 @@ static int vc_sm_cma_vchi_videocore_io(void *arg)
 			}
 			cmd = list_first_entry(&instance->cmd_list,
 					       struct sm_cmd_rsp_blk, head);
-			list_move(&cmd->head, &instance->rsp_list);
+			list_del(&cmd->head);
+			status = 0;
+			if (cmd->wait)
+				status = xa_err(xa_store(&instance->rsp_map,
+							 cmd->id, cmd,
+							 GFP_KERNEL));
 			cmd->sent = 1;
 			mutex_unlock(&instance->lock);
 
+			if (status) {
+				/* Can't match a reply, so fail it unsent */
+				pr_err("%s: failed to track command %u (%d)",
+				       __func__, cmd->id, status);
+				cmd->error = status;
+				complete(&cmd->cmplt);
+				continue;
+			}
+
 			/* Send the command */
 			status =
 				bcm2835_vchi_msg_queue(instance->vchi_handle[0],
@@ -222,15 +273,17 @@ static int vc_sm_cma_vchi_videocore_io(void *arg)
 
 			/* If no reply is needed then we're done */
 			if (!cmd->wait) {
-				mutex_lock(&instance->lock);
-				list_del(&cmd->head);
-				mutex_unlock(&instance->lock);
 				vc_vchi_cmd_delete(instance, cmd);
 				continue;
 			}
 
 			if (status) {
-				complete(&cmd->cmplt);
+				cmd = vc_sm_cma_vchi_rsp_take(instance,
+							      cmd->id);
+				if (cmd) {
+					cmd->error = -EIO;
+					complete(&cmd->cmplt);
+				}
 				continue;
 			}
 
@@ -244,21 +297,12 @@ static int vc_sm_cma_vchi_videocore_io(void *arg)
 					instance->vpu_event(instance, reply,
 							    reply_len);
 			} else {
-				vc_sm_cma_vchi_rx_ack(instance, cmd, reply,
+				vc_sm_cma_vchi_rx_ack(instance, reply,
 						      reply_len);
 			}
 
 			vchi_msg_remove(instance->vchi_handle[0]);
 		}
-
-		/* Go through the dead list and free them */
-		mutex_lock(&instance->lock);
-		list_for_each_entry_safe(cmd, cmd_tmp, &instance->dead_list,
-					 head) {
-			list_del(&cmd->head);
-			vc_vchi_cmd_delete(instance, cmd);
-		}
-		mutex_unlock(&instance->lock);
 	}
 
 	return 0;
@@ -307,8 +351,7 @@ struct sm_instance *vc_sm_cma_vchi_init(VCHI_INSTANCE_T vchi_instance,
 	mutex_init(&instance->lock);
 	init_completion(&instance->io_cmplt);
 	INIT_LIST_HEAD(&instance->cmd_list);
-	INIT_LIST_HEAD(&instance->rsp_list);
-	INIT_LIST_HEAD(&instance->dead_list);
+	xa_init(&instance->rsp_map);
 	INIT_LIST_HEAD(&instance->free_list);
 	sema_init(&instance->free_sema, SM_MAX_NUM_CMD_RSP_BLKS);
 	mutex_init(&instance->free_lock);
@@ -389,6 +432,7 @@ int vc_sm_cma_vchi_stop(struct sm_instance **handle)
 		success = vchi_service_close(instance->vchi_handle[i]);
 	}
 
+	xa_destroy(&instance->rsp_map);
 	kfree(instance);
 
 	*handle = NULL;
@@ -398,30 +442,20 @@ lock:
 	return -EINVAL;
 }
 
-static int vc_sm_cma_vchi_send_msg(struct sm_instance *handle,
-				   enum vc_sm_msg_type msg_id, void *msg,
-				   u32 msg_size, void *result, u32 result_size,
-				   u32 *cur_trans_id, u8 wait_reply)
+/* Create a command block for @msg and append it to the command list. */
+static struct sm_cmd_rsp_blk *
+vc_sm_cma_vchi_queue_msg(struct sm_instance *instance,
+			 enum vc_sm_msg_type msg_id, void *msg, u32 msg_size,
+			 u32 *cur_trans_id, u8 wait_reply)
 {
-	int status = 0;
-	struct sm_instance *instance = handle;
 	struct sm_cmd_rsp_blk *cmd_blk;
 
-	if (!handle) {
-		pr_err("%s: invalid handle", __func__);
-		return -EINVAL;
-	}
-	if (!msg) {
-		pr_err("%s: invalid msg pointer", __func__);
-		return -EINVAL;
-	}
-
 	cmd_blk =
 	    vc_vchi_cmd_create(instance, msg_id, msg, msg_size, wait_reply);
 	if (!cmd_blk) {
 		pr_err("[%s]: failed to allocate global tracking resource",
 		       __func__);
-		return -ENOMEM;
+		return NULL;
 	}
 
 	if (cur_trans_id)
@@ -430,13 +464,17 @@ static int vc_sm_cma_vchi_send_msg(struct sm_instance *handle,
 	mutex_lock(&instance->lock);
 	list_add_tail(&cmd_blk->head, &instance->cmd_list);
 	mutex_unlock(&instance->lock);
-	complete(&instance->io_cmplt);
 
-	if (!wait_reply)
-		/* We're done */
-		return 0;
+	return cmd_blk;
+}
+
+/* Wait for the reply to a queued command and release the command block. */
+static int vc_sm_cma_vchi_wait_msg(struct sm_instance *instance,
+				   struct sm_cmd_rsp_blk *cmd_blk,
+				   void *result, u32 result_size)
+{
+	int status = 0;
 
-	/* Wait for the response */
 	if (wait_for_completion_interruptible(&cmd_blk->cmplt)) {
 		mutex_lock(&instance->lock);
 		if (!cmd_blk->sent) {
@@ -446,13 +484,26 @@ static int vc_sm_cma_vchi_send_msg(struct sm_instance *handle,
 			return -ENXIO;
 		}
 
-		list_move(&cmd_blk->head, &instance->dead_list);
+		if (xa_load(&instance->rsp_map, cmd_blk->id) == cmd_blk) {
+			/* Still awaiting the reply - free it on arrival. */
+			cmd_blk->dead = 1;
+			mutex_unlock(&instance->lock);
+			return -EINTR;
+		}
 		mutex_unlock(&instance->lock);
-		complete(&instance->io_cmplt);
+
+		/*
+		 * The reply raced with the interruption and is being
+		 * completed, so wait for that to finish before freeing it.
+		 */
+		wait_for_completion(&cmd_blk->cmplt);
+		vc_vchi_cmd_delete(instance, cmd_blk);
 		return -EINTR;	/* We're done */
 	}
 
-	if (result && result_size) {
+	if (cmd_blk->error) {
+		status = cmd_blk->error;
+	} else if (result && result_size) {
 		memcpy(result, cmd_blk->msg, result_size);
 	} else {
 		struct vc_sm_result_t *res =
@@ -460,13 +511,41 @@ static int vc_sm_cma_vchi_send_msg(struct sm_instance *handle,
 		status = (res->success == 0) ? 0 : -ENXIO;
 	}
 
-	mutex_lock(&instance->lock);
-	list_del(&cmd_blk->head);
-	mutex_unlock(&instance->lock);
 	vc_vchi_cmd_delete(instance, cmd_blk);
 	return status;
 }
 
+static int vc_sm_cma_vchi_send_msg(struct sm_instance *handle,
+				   enum vc_sm_msg_type msg_id, void *msg,
+				   u32 msg_size, void *result, u32 result_size,
+				   u32 *cur_trans_id, u8 wait_reply)
+{
+	struct sm_instance *instance = handle;
+	struct sm_cmd_rsp_blk *cmd_blk;
+
+	if (!handle) {
+		pr_err("%s: invalid handle", __func__);
+		return -EINVAL;
+	}
+	if (!msg) {
+		pr_err("%s: invalid msg pointer", __func__);
+		return -EINVAL;
+	}
+
+	cmd_blk = vc_sm_cma_vchi_queue_msg(instance, msg_id, msg, msg_size,
+					   cur_trans_id, wait_reply);
+	if (!cmd_blk)
+		return -ENOMEM;
+	complete(&instance->io_cmplt);
+
+	if (!wait_reply)
+		/* We're done */
+		return 0;
+
+	/* Wait for the response */
+	return vc_sm_cma_vchi_wait_msg(instance, cmd_blk, result, result_size);
+}
+
 int vc_sm_cma_vchi_free(struct sm_instance *handle, struct vc_sm_free_t *msg,
 			u32 *cur_trans_id)
 {
@@ -482,6 +561,58 @@ int vc_sm_cma_vchi_import(struct sm_instance *handle, struct vc_sm_import *msg,
 				   cur_trans_id, 1);
 }
 
+int vc_sm_cma_vchi_import_batch(struct sm_instance *handle,
+				struct vc_sm_import *msgs,
+				struct vc_sm_import_result *results,
+				int *status, unsigned int count,
+				u32 *cur_trans_id)
+{
+	struct sm_cmd_rsp_blk *cmd_blks[SM_IMPORT_BATCH_SIZE];
+	unsigned int i, j, n;
+	int ret = 0;
+
+	if (!handle) {
+		pr_err("%s: invalid handle", __func__);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < count; i += n) {
+		n = min_t(unsigned int, count - i, SM_IMPORT_BATCH_SIZE);
+
+		/*
+		 * Wake the io thread after each command rather than once per
+		 * window: queueing blocks while the command blocks are all in
+		 * use, and only replies to commands already sent free them.
+		 * Replies are still only waited for once the window is queued.
+		 */
+		for (j = 0; j < n; j++) {
+			cmd_blks[j] =
+				vc_sm_cma_vchi_queue_msg(handle,
+							 VC_SM_MSG_TYPE_IMPORT,
+							 &msgs[i + j],
+							 sizeof(*msgs),
+							 cur_trans_id, 1);
+			complete(&handle->io_cmplt);
+		}
+
+		for (j = 0; j < n; j++) {
+			if (cmd_blks[j])
+				status[i + j] =
+					vc_sm_cma_vchi_wait_msg(handle,
+								cmd_blks[j],
+								&results[i + j],
+								sizeof(*results));
+			else
+				status[i + j] = -ENOMEM;
+
+			if (status[i + j] && !ret)
+				ret = status[i + j];
+		}
+	}
+
+	return ret;
+}
+
 int vc_sm_cma_vchi_client_version(struct sm_instance *handle,
 				  struct vc_sm_version *msg,
 				  struct vc_sm_result_t *result,
@@ -51,6 +51,17 @@ int vc_sm_cma_vchi_import(struct sm_instance *handle, struct vc_sm_import *msg,
 			  struct vc_sm_import_result *result,
 			  u32 *cur_trans_id);
 
+/*
+ * Import @count blocks, pipelining the requests to the VPU rather than waiting
+ * for each reply in turn. The status of each import is returned in @status,
+ * and the first failure as the return value.
+ */
+int vc_sm_cma_vchi_import_batch(struct sm_instance *handle,
+				struct vc_sm_import *msgs,
+				struct vc_sm_import_result *results,
+				int *status, unsigned int count,
+				u32 *cur_trans_id);
+
 int vc_sm_cma_vchi_client_version(struct sm_instance *handle,
 				  struct vc_sm_version *msg,
 				  struct vc_sm_result_t *result,
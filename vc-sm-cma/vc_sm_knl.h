@@ -19,10 +19,17 @@
 /* Free a previously allocated or imported shared memory handle and block. */
 int vc_sm_cma_free(void *handle);
 
+/* Release the cached VPU import of a dmabuf that is going away. */
+void vc_sm_cma_import_cache_drop(struct dma_buf *dmabuf);
+
 /* Get an internal resource handle mapped from the external one. */
 int vc_sm_cma_int_handle(void *handle);
 
 /* Import a block of memory into the GPU space. */
 int vc_sm_cma_import_dmabuf(struct dma_buf *dmabuf, void **handle);
 
+/* Import a set of blocks of memory into the GPU space in one go. */
+int vc_sm_cma_import_dmabufs(struct dma_buf **dmabufs, void **handles,
+			     unsigned int count);
+
 #endif /* __VC_SM_KNL_H__INCLUDED__ */
@@ -45,4 +45,17 @@ struct mmal_rational {
 	s32 den;    /**< Denominator */
 };
 
+enum mmal_core_stats_dir {
+	MMAL_CORE_STATS_RX,  /**< Buffers received by the port */
+	MMAL_CORE_STATS_TX,  /**< Buffers sent by the port */
+	MMAL_CORE_STATS_MAX = 0x7fffffff,
+};
+
+struct mmal_core_statistics {
+	u32 buffer_count;      /**< Total buffer count on this port */
+	u32 first_buffer_time; /**< Time (us) of first buffer seen */
+	u32 last_buffer_time;  /**< Time (us) of most recent buffer */
+	u32 max_delay;         /**< Max delay (us) between buffers */
+};
+
 #endif /* MMAL_MSG_COMMON_H */
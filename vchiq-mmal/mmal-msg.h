@@ -344,6 +344,31 @@ struct mmal_msg_port_parameter_get_reply {
 	u32 value[MMAL_WORKER_PORT_PARAMETER_SPACE];
 };
 
+/* port core statistics */
+
+#define MMAL_MSG_COMPONENT_NAME_SIZE 128
+
+enum mmal_msg_stats_result {
+	MMAL_MSG_STATS_FOUND,
+	MMAL_MSG_STATS_COMPONENT_NOT_FOUND,
+	MMAL_MSG_STATS_PORT_NOT_FOUND,
+};
+
+struct mmal_msg_get_core_stats_for_port {
+	u32 component_handle;	/* component */
+	u32 port_index;		/* index of the port in its type list */
+	u32 type;		/* enum mmal_port_type */
+	u32 dir;		/* enum mmal_core_stats_dir */
+	u32 reset;		/* reset the counters after reading */
+};
+
+struct mmal_msg_get_core_stats_for_port_reply {
+	u32 status;		/* enum mmal_msg_status */
+	u32 result;		/* enum mmal_msg_stats_result */
+	struct mmal_core_statistics stats;
+	char component_name[MMAL_MSG_COMPONENT_NAME_SIZE];
+};
+
 /* event messages */
 #define MMAL_WORKER_EVENT_SPACE 256
 
@@ -436,6 +461,11 @@ struct mmal_msg {
 
 		struct mmal_msg_event_to_host event_to_host;
 
+		struct mmal_msg_get_core_stats_for_port
+			get_core_stats_for_port;
+		struct mmal_msg_get_core_stats_for_port_reply
+			get_core_stats_for_port_reply;
+
 		u8 payload[MMAL_MSG_MAX_PAYLOAD];
 	} u;
 };
@@ -499,6 +499,35 @@ struct mmal_parameter_video_profile {
 	enum mmal_video_level level;
 };
 
+enum mmal_video_intra_refresh {
+	MMAL_VIDEO_INTRA_REFRESH_CYCLIC,
+	MMAL_VIDEO_INTRA_REFRESH_ADAPTIVE,
+	MMAL_VIDEO_INTRA_REFRESH_BOTH,
+	MMAL_VIDEO_INTRA_REFRESH_KHRONOSEXTENSIONS = 0x6F000000,
+	MMAL_VIDEO_INTRA_REFRESH_VENDORSTARTUNUSED = 0x7F000000,
+	MMAL_VIDEO_INTRA_REFRESH_CYCLIC_MROWS,
+	MMAL_VIDEO_INTRA_REFRESH_PSEUDO_RAND,
+	MMAL_VIDEO_INTRA_REFRESH_MAX,
+	MMAL_VIDEO_INTRA_REFRESH_DUMMY = 0x7FFFFFFF
+};
+
+struct mmal_parameter_video_intra_refresh {
+	enum mmal_video_intra_refresh refresh_mode;
+	u32 air_mbs;
+	u32 air_ref;
+	u32 cir_mbs;
+	u32 pir_mbs;
+};
+
+enum mmal_video_encode_rc_model {
+	MMAL_VIDEO_ENCODER_RC_MODEL_DEFAULT = 0,
+	MMAL_VIDEO_ENCODER_RC_MODEL_JVT = MMAL_VIDEO_ENCODER_RC_MODEL_DEFAULT,
+	MMAL_VIDEO_ENCODER_RC_MODEL_VOWIFI,
+	MMAL_VIDEO_ENCODER_RC_MODEL_CBR,
+	MMAL_VIDEO_ENCODER_RC_MODEL_LAST,
+	MMAL_VIDEO_ENCODER_RC_MODEL_DUMMY = 0x7FFFFFFF
+};
+
 /* video parameters */
 
 enum mmal_parameter_video_type {
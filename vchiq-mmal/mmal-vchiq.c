@@ -23,6 +23,10 @@
 #include <linux/slab.h>
 #include <linux/completion.h>
 #include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/xarray.h>
 #include <media/videobuf2-vmalloc.h>
 
 #include "mmal-common.h"
@@ -40,12 +44,6 @@ MODULE_AUTHOR("Dave Stevenson, <dave.stevenson@raspberrypi.org>");
 MODULE_LICENSE("GPL");
 MODULE_VERSION("0.0.1");
 
-/*
- * maximum number of components supported.
- * This matches the maximum permitted by default on the VPU
- */
-#define VCHIQ_MMAL_MAX_COMPONENTS 64
-
 /*
  * Timeout for synchronous msg responses in seconds.
  * Helpful to increase this if stopping in the VPU debugger.
@@ -187,12 +185,27 @@ struct vchiq_mmal_instance {
 	/* protect accesses to context_map */
 	struct mutex context_map_lock;
 
-	struct vchiq_mmal_component component[VCHIQ_MMAL_MAX_COMPONENTS];
+	/* components allocated on demand, indexed by client_component */
+	struct xarray components;
 
 	/* ordered workqueue to process all bulk operations */
 	struct workqueue_struct *bulk_wq;
+
+	/* port info round trips sent and avoided by the port shadows */
+	struct {
+		u32 info_set_sent;
+		u32 info_set_skipped;
+		u32 info_get_sent;
+		u32 info_get_skipped;
+	} stats;
+
+	struct dentry *debugfs_dir;
 };
 
+/* debugfs directory shared by all instances */
+static struct dentry *mmal_debugfs_root;
+static atomic_t mmal_instance_id = ATOMIC_INIT(0);
+
 static struct mmal_msg_context *
 get_msg_context(struct vchiq_mmal_instance *instance)
 {
@@ -456,15 +469,12 @@ buffer_from_host(struct vchiq_mmal_instance *instance,
 	/* no payload in message */
 	m.u.buffer_from_host.payload_in_message = 0;
 
-	vchi_service_use(instance->handle);
-
+	/* caller holds a vchi_service_use reference */
 	ret = vchi_queue_kernel_message(instance->handle,
 					&m,
 					sizeof(struct mmal_msg_header) +
 					sizeof(m.u.buffer_from_host));
 
-	vchi_service_release(instance->handle);
-
 	return ret;
 }
 
@@ -472,9 +482,8 @@ buffer_from_host(struct vchiq_mmal_instance *instance,
 static void event_to_host_cb(struct vchiq_mmal_instance *instance,
 			     struct mmal_msg *msg, u32 msg_len)
 {
-	int comp_idx = msg->u.event_to_host.client_component;
-	struct vchiq_mmal_component *component =
-					&instance->component[comp_idx];
+	u32 comp_idx = msg->u.event_to_host.client_component;
+	struct vchiq_mmal_component *component;
 	struct vchiq_mmal_port *port = NULL;
 	struct mmal_msg_context *msg_context;
 	u32 port_num = msg->u.event_to_host.port_num;
@@ -485,6 +494,18 @@ static void event_to_host_cb(struct vchiq_mmal_instance *instance,
 		return;
 	}
 
+	/*
+	 * Events are delivered in order with the replies on this service, so
+	 * a component can't be freed under us: that only happens once the
+	 * reply to its destroy message has been received.
+	 */
+	component = xa_load(&instance->components, comp_idx);
+	if (!component) {
+		pr_err("%s: event for unknown component %u\n", __func__,
+		       comp_idx);
+		return;
+	}
+
 	switch (msg->u.event_to_host.port_type) {
 	case MMAL_PORT_TYPE_CONTROL:
 		if (port_num) {
@@ -525,6 +546,10 @@ static void event_to_host_cb(struct vchiq_mmal_instance *instance,
 		break;
 	}
 
+	if (msg->u.event_to_host.cmd == MMAL_EVENT_FORMAT_CHANGED ||
+	    msg->u.event_to_host.cmd == MMAL_EVENT_PARAMETER_CHANGED)
+		WRITE_ONCE(port->shadow.valid, false);
+
 	if (!mutex_trylock(&port->event_context_mutex)) {
 		pr_err("dropping event 0x%x\n", msg->u.event_to_host.cmd);
 		return;
@@ -906,6 +931,58 @@ static void port_to_mmal_msg(struct vchiq_mmal_port *port, struct mmal_port *p)
 	p->userdata = (u32)(unsigned long)port;
 }
 
+static void port_shadow_update(struct vchiq_mmal_port *port)
+{
+	struct vchiq_mmal_port_shadow *shadow = &port->shadow;
+
+	shadow->current_buffer = port->current_buffer;
+	shadow->type = port->format.type;
+	shadow->encoding = port->format.encoding;
+	shadow->encoding_variant = port->format.encoding_variant;
+	shadow->bitrate = port->format.bitrate;
+	shadow->flags = port->format.flags;
+	memcpy(&shadow->es, &port->es, sizeof(shadow->es));
+	WRITE_ONCE(shadow->valid, true);
+}
+
+/* true if the port holds exactly what the VPU last reported */
+static bool port_shadow_matches(struct vchiq_mmal_port *port)
+{
+	struct vchiq_mmal_port_shadow *shadow = &port->shadow;
+
+	if (!READ_ONCE(shadow->valid))
+		return false;
+
+	/* extradata is not shadowed, so always send it */
+	if (port->format.extradata_size)
+		return false;
+
+	return shadow->current_buffer.num == port->current_buffer.num &&
+	       shadow->current_buffer.size == port->current_buffer.size &&
+	       shadow->type == port->format.type &&
+	       shadow->encoding == port->format.encoding &&
+	       shadow->encoding_variant == port->format.encoding_variant &&
+	       shadow->bitrate == port->format.bitrate &&
+	       shadow->flags == port->format.flags &&
+	       !memcmp(&shadow->es, &port->es, sizeof(shadow->es));
+}
+
+/* Changing one port can make the VPU renegotiate any other port on the
+ * same component, so drop all of the component's shadows.
+ */
+static void component_shadow_invalidate(struct vchiq_mmal_component *component)
+{
+	int idx;
+
+	WRITE_ONCE(component->control.shadow.valid, false);
+	for (idx = 0; idx < component->inputs; idx++)
+		WRITE_ONCE(component->input[idx].shadow.valid, false);
+	for (idx = 0; idx < component->outputs; idx++)
+		WRITE_ONCE(component->output[idx].shadow.valid, false);
+	for (idx = 0; idx < component->clocks; idx++)
+		WRITE_ONCE(component->clock[idx].shadow.valid, false);
+}
+
 static int port_info_set(struct vchiq_mmal_instance *instance,
 			 struct vchiq_mmal_port *port)
 {
@@ -942,6 +1019,9 @@ static int port_info_set(struct vchiq_mmal_instance *instance,
 	memcpy(&m.u.port_info_set.extradata, port->format.extradata,
 	       port->format.extradata_size);
 
+	component_shadow_invalidate(port->component);
+	instance->stats.info_set_sent++;
+
 	ret = send_synchronous_mmal_msg(instance, &m,
 					sizeof(m.u.port_info_set),
 					&rmsg, &rmsg_handle);
@@ -981,6 +1061,8 @@ static int port_info_get(struct vchiq_mmal_instance *instance,
 	m.u.port_info_get.port_type = port->type;
 	m.u.port_info_get.index = port->index;
 
+	instance->stats.info_get_sent++;
+
 	ret = send_synchronous_mmal_msg(instance, &m,
 					sizeof(m.u.port_info_get),
 					&rmsg, &rmsg_handle);
@@ -1048,6 +1130,8 @@ static int port_info_get(struct vchiq_mmal_instance *instance,
 	       rmsg->u.port_info_get_reply.extradata,
 	       port->format.extradata_size);
 
+	port_shadow_update(port);
+
 	pr_debug("received port info\n");
 	dump_port_info(port);
 
@@ -1061,6 +1145,39 @@ release_msg:
 	return ret;
 }
 
+/* set the port format and read back what the VPU applied, unless the
+ * port already matches the last reported configuration
+ */
+static int port_info_commit(struct vchiq_mmal_instance *instance,
+			    struct vchiq_mmal_port *port)
+{
+	int ret;
+
+	if (port_shadow_matches(port)) {
+		instance->stats.info_set_skipped++;
+		instance->stats.info_get_skipped++;
+		return 0;
+	}
+
+	ret = port_info_set(instance, port);
+	if (ret)
+		return ret;
+
+	return port_info_get(instance, port);
+}
+
+/* re-read port info only if the local copy may be stale */
+static int port_info_refresh(struct vchiq_mmal_instance *instance,
+			     struct vchiq_mmal_port *port)
+{
+	if (port_shadow_matches(port)) {
+		instance->stats.info_get_skipped++;
+		return 0;
+	}
+
+	return port_info_get(instance, port);
+}
+
 /* create comonent on vc */
 static int create_component(struct vchiq_mmal_instance *instance,
 			    struct vchiq_mmal_component *component,
@@ -1360,6 +1477,9 @@ static int port_parameter_set(struct vchiq_mmal_instance *instance,
 
 	ret = -rmsg->u.port_parameter_set_reply.status;
 
+	/* parameters may change the port format or buffer requirements */
+	component_shadow_invalidate(port->component);
+
 	pr_debug("%s:result:%d component:0x%x port:%d parameter:%d\n",
 		 __func__,
 		 ret, port->component->handle, port->handle, parameter_id);
@@ -1429,6 +1549,58 @@ release_msg:
 	return ret;
 }
 
+static int port_get_core_stats(struct vchiq_mmal_instance *instance,
+			       struct vchiq_mmal_port *port,
+			       enum mmal_core_stats_dir dir, bool reset,
+			       struct mmal_core_statistics *stats)
+{
+	int ret;
+	struct mmal_msg m;
+	struct mmal_msg *rmsg;
+	struct vchi_held_msg rmsg_handle;
+
+	m.h.type = MMAL_MSG_TYPE_GET_CORE_STATS_FOR_PORT;
+
+	m.u.get_core_stats_for_port.component_handle =
+						port->component->handle;
+	m.u.get_core_stats_for_port.port_index = port->index;
+	m.u.get_core_stats_for_port.type = port->type;
+	m.u.get_core_stats_for_port.dir = dir;
+	m.u.get_core_stats_for_port.reset = reset;
+
+	ret = send_synchronous_mmal_msg(instance, &m,
+					sizeof(m.u.get_core_stats_for_port),
+					&rmsg, &rmsg_handle);
+	if (ret)
+		return ret;
+
+	if (rmsg->h.type != MMAL_MSG_TYPE_GET_CORE_STATS_FOR_PORT) {
+		/* got an unexpected message type in reply */
+		ret = -EINVAL;
+		goto release_msg;
+	}
+
+	ret = -rmsg->u.get_core_stats_for_port_reply.status;
+	if (ret)
+		goto release_msg;
+
+	if (rmsg->u.get_core_stats_for_port_reply.result !=
+	    MMAL_MSG_STATS_FOUND) {
+		ret = -ENOENT;
+		goto release_msg;
+	}
+
+	*stats = rmsg->u.get_core_stats_for_port_reply.stats;
+
+release_msg:
+	pr_debug("%s:result:%d component:0x%x port:%d dir:%d\n",
+		 __func__, ret, port->component->handle, port->handle, dir);
+
+	vchi_held_msg_release(&rmsg_handle);
+
+	return ret;
+}
+
 /* disables a port and drains buffers from it */
 static int port_disable(struct vchiq_mmal_instance *instance,
 			struct vchiq_mmal_port *port)
@@ -1474,7 +1646,7 @@ static int port_disable(struct vchiq_mmal_instance *instance,
 
 		spin_unlock_irqrestore(&port->slock, flags);
 
-		ret = port_info_get(instance, port);
+		ret = port_info_refresh(instance, port);
 	}
 
 	return ret;
@@ -1501,6 +1673,7 @@ static int port_enable(struct vchiq_mmal_instance *instance,
 	if (port->buffer_cb) {
 		/* send buffer headers to videocore */
 		hdr_count = 1;
+		vchi_service_use(instance->handle);
 		list_for_each_safe(buf_head, q, &port->buffers) {
 			struct mmal_buffer *mmalbuf;
 
@@ -1508,16 +1681,19 @@ static int port_enable(struct vchiq_mmal_instance *instance,
 					     list);
 			ret = buffer_from_host(instance, port, mmalbuf);
 			if (ret)
-				goto done;
+				break;
 
 			list_del(buf_head);
 			hdr_count++;
 			if (hdr_count > port->current_buffer.num)
 				break;
 		}
+		vchi_service_release(instance->handle);
+		if (ret)
+			goto done;
 	}
 
-	ret = port_info_get(instance, port);
+	ret = port_info_refresh(instance, port);
 
 done:
 	return ret;
@@ -1536,14 +1712,8 @@ int vchiq_mmal_port_set_format(struct vchiq_mmal_instance *instance,
 	if (mutex_lock_interruptible(&instance->vchiq_mutex))
 		return -EINTR;
 
-	ret = port_info_set(instance, port);
-	if (ret)
-		goto release_unlock;
-
-	/* read what has actually been set */
-	ret = port_info_get(instance, port);
+	ret = port_info_commit(instance, port);
 
-release_unlock:
 	mutex_unlock(&instance->vchiq_mutex);
 
 	return ret;
@@ -1587,6 +1757,24 @@ int vchiq_mmal_port_parameter_get(struct vchiq_mmal_instance *instance,
 }
 EXPORT_SYMBOL_GPL(vchiq_mmal_port_parameter_get);
 
+int vchiq_mmal_port_get_core_stats(struct vchiq_mmal_instance *instance,
+				   struct vchiq_mmal_port *port,
+				   enum mmal_core_stats_dir dir, bool reset,
+				   struct mmal_core_statistics *stats)
+{
+	int ret;
+
+	if (mutex_lock_interruptible(&instance->vchiq_mutex))
+		return -EINTR;
+
+	ret = port_get_core_stats(instance, port, dir, reset, stats);
+
+	mutex_unlock(&instance->vchiq_mutex);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(vchiq_mmal_port_get_core_stats);
+
 /* enable a port
  *
  * enables a port and queues buffers for satisfying callbacks if we
@@ -1693,20 +1881,13 @@ int vchiq_mmal_port_connect_tunnel(struct vchiq_mmal_instance *instance,
 	dst->es.video.frame_rate.num = src->es.video.frame_rate.num;
 	dst->es.video.frame_rate.den = src->es.video.frame_rate.den;
 
-	/* set new format */
-	ret = port_info_set(instance, dst);
+	/* set new format, reading back what has actually been set */
+	ret = port_info_commit(instance, dst);
 	if (ret) {
 		pr_debug("setting port info failed\n");
 		goto release_unlock;
 	}
 
-	/* read what has actually been set */
-	ret = port_info_get(instance, dst);
-	if (ret) {
-		pr_debug("read back port info failed\n");
-		goto release_unlock;
-	}
-
 	/* connect two ports together */
 	ret = port_action_handle(instance, src,
 				 MMAL_MSG_PORT_ACTION_TYPE_CONNECT,
@@ -1727,9 +1908,9 @@ release_unlock:
 }
 EXPORT_SYMBOL_GPL(vchiq_mmal_port_connect_tunnel);
 
-int vchiq_mmal_submit_buffer(struct vchiq_mmal_instance *instance,
-			     struct vchiq_mmal_port *port,
-			     struct mmal_buffer *buffer)
+static int submit_buffer(struct vchiq_mmal_instance *instance,
+			 struct vchiq_mmal_port *port,
+			 struct mmal_buffer *buffer)
 {
 	unsigned long flags = 0;
 	int ret;
@@ -1769,8 +1950,100 @@ int vchiq_mmal_submit_buffer(struct vchiq_mmal_instance *instance,
 
 	return 0;
 }
+
+int vchiq_mmal_submit_buffer(struct vchiq_mmal_instance *instance,
+			     struct vchiq_mmal_port *port,
+			     struct mmal_buffer *buffer)
+{
+	int ret;
+
+	vchi_service_use(instance->handle);
+	ret = submit_buffer(instance, port, buffer);
+	vchi_service_release(instance->handle);
+
+	return ret;
+}
 EXPORT_SYMBOL_GPL(vchiq_mmal_submit_buffer);
 
+/* Maximum number of dmabufs imported into VCSM in one batch */
+#define MMAL_IMPORT_BATCH_SIZE 16
+
+/*
+ * Import the dmabufs of any buffers that don't yet have a VCSM handle as one
+ * batch, rather than paying a VPU round trip per buffer in submit_buffer.
+ * On failure the buffers are left for submit_buffer to import and report on
+ * individually.
+ */
+static void import_buffers(struct vchiq_mmal_port *port,
+			   struct mmal_buffer **buffers,
+			   unsigned int num_buffers)
+{
+	struct mmal_buffer *bufs[MMAL_IMPORT_BATCH_SIZE];
+	struct dma_buf *dma_bufs[MMAL_IMPORT_BATCH_SIZE];
+	void *handles[MMAL_IMPORT_BATCH_SIZE];
+	unsigned int i, j, n = 0;
+	int ret;
+
+	if (!port->zero_copy)
+		return;
+
+	for (i = 0; i < num_buffers; i++) {
+		if (buffers[i]->dma_buf && !buffers[i]->vcsm_handle) {
+			bufs[n] = buffers[i];
+			dma_bufs[n] = buffers[i]->dma_buf;
+			n++;
+		}
+
+		if (n < MMAL_IMPORT_BATCH_SIZE && i < num_buffers - 1)
+			continue;
+		if (!n)
+			continue;
+
+		ret = vc_sm_cma_import_dmabufs(dma_bufs, handles, n);
+		if (ret) {
+			pr_debug("%s: batch import of %u dmabufs failed, ret %d\n",
+				 __func__, n, ret);
+		} else {
+			for (j = 0; j < n; j++) {
+				bufs[j]->vcsm_handle = handles[j];
+				bufs[j]->vc_handle =
+					vc_sm_cma_int_handle(handles[j]);
+			}
+		}
+		n = 0;
+	}
+}
+
+/*
+ * Submit several buffers to a port, holding the service for the whole batch.
+ * Submission stops at the first buffer that fails. Returns the number of
+ * buffers submitted; the caller still owns any after that.
+ */
+unsigned int vchiq_mmal_submit_buffers(struct vchiq_mmal_instance *instance,
+				       struct vchiq_mmal_port *port,
+				       struct mmal_buffer **buffers,
+				       unsigned int num_buffers)
+{
+	unsigned int i;
+
+	vchi_service_use(instance->handle);
+	if (num_buffers > 1)
+		import_buffers(port, buffers, num_buffers);
+	for (i = 0; i < num_buffers; i++) {
+		int ret = submit_buffer(instance, port, buffers[i]);
+
+		if (ret) {
+			pr_err("%s: failed submitting buffer %u of %u, ret %d\n",
+			       __func__, i, num_buffers, ret);
+			break;
+		}
+	}
+	vchi_service_release(instance->handle);
+
+	return i;
+}
+EXPORT_SYMBOL_GPL(vchiq_mmal_submit_buffers);
+
 int mmal_vchi_buffer_init(struct vchiq_mmal_instance *instance,
 			  struct mmal_buffer *buf)
 {
@@ -1798,6 +2071,11 @@ int mmal_vchi_buffer_unmap(struct mmal_buffer *buf)
 			pr_err("%s: vcsm_free failed, ret %d\n", __func__, ret);
 		buf->vcsm_handle = 0;
 	}
+	/*
+	 * Callers unmap when done with the dmabuf, eg before putting a vb2
+	 * export, so don't leave it pinned by the import cache.
+	 */
+	vc_sm_cma_import_cache_drop(buf->dma_buf);
 	return ret;
 }
 EXPORT_SYMBOL_GPL(mmal_vchi_buffer_unmap);
@@ -1869,6 +2147,97 @@ static void release_all_event_contexts(struct vchiq_mmal_component *component)
 	free_event_context(&component->control);
 }
 
+static void port_core_stats_show(struct seq_file *s,
+				 struct vchiq_mmal_instance *instance,
+				 struct vchiq_mmal_port *port,
+				 enum mmal_core_stats_dir dir)
+{
+	struct mmal_core_statistics stats;
+	u32 elapsed, fps_x100 = 0;
+	int ret;
+
+	ret = vchiq_mmal_port_get_core_stats(instance, port, dir, false,
+					     &stats);
+	if (ret) {
+		seq_printf(s, "vpu %s: unavailable (%d)\n",
+			   dir == MMAL_CORE_STATS_RX ? "rx" : "tx", ret);
+		return;
+	}
+
+	elapsed = stats.last_buffer_time - stats.first_buffer_time;
+	if (stats.buffer_count > 1 && elapsed)
+		fps_x100 = div_u64((u64)(stats.buffer_count - 1) * 100000000,
+				   elapsed);
+
+	seq_printf(s, "vpu %s: buffers:%u first:%uus last:%uus max_delay:%uus fps:%u.%02u\n",
+		   dir == MMAL_CORE_STATS_RX ? "rx" : "tx",
+		   stats.buffer_count, stats.first_buffer_time,
+		   stats.last_buffer_time, stats.max_delay,
+		   fps_x100 / 100, fps_x100 % 100);
+}
+
+static int vchiq_mmal_port_stats_show(struct seq_file *s, void *v)
+{
+	struct vchiq_mmal_port *port = s->private;
+	struct vchiq_mmal_instance *instance = port->component->instance;
+	struct list_head *buf_head;
+	unsigned int queued = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->slock, flags);
+	list_for_each(buf_head, &port->buffers)
+		queued++;
+	spin_unlock_irqrestore(&port->slock, flags);
+
+	seq_printf(s, "handle:0x%x enabled:%d zero_copy:%d\n",
+		   port->handle, port->enabled, port->zero_copy);
+	seq_printf(s, "buffer num:%u size:%u min num:%u size:%u\n",
+		   port->current_buffer.num, port->current_buffer.size,
+		   port->minimum_buffer.num, port->minimum_buffer.size);
+	seq_printf(s, "host buffers_with_vpu:%d queued:%u\n",
+		   atomic_read(&port->buffers_with_vpu), queued);
+
+	port_core_stats_show(s, instance, port, MMAL_CORE_STATS_RX);
+	port_core_stats_show(s, instance, port, MMAL_CORE_STATS_TX);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vchiq_mmal_port_stats);
+
+static void component_debugfs_init(struct vchiq_mmal_instance *instance,
+				   struct vchiq_mmal_component *component,
+				   const char *name)
+{
+	char dname[48];
+	int idx;
+
+	snprintf(dname, sizeof(dname), "%u-%s", component->client_component,
+		 name);
+	component->debugfs_dir = debugfs_create_dir(dname,
+						    instance->debugfs_dir);
+
+	debugfs_create_file("control", 0444, component->debugfs_dir,
+			    &component->control, &vchiq_mmal_port_stats_fops);
+	for (idx = 0; idx < component->inputs; idx++) {
+		snprintf(dname, sizeof(dname), "input%d", idx);
+		debugfs_create_file(dname, 0444, component->debugfs_dir,
+				    &component->input[idx],
+				    &vchiq_mmal_port_stats_fops);
+	}
+	for (idx = 0; idx < component->outputs; idx++) {
+		snprintf(dname, sizeof(dname), "output%d", idx);
+		debugfs_create_file(dname, 0444, component->debugfs_dir,
+				    &component->output[idx],
+				    &vchiq_mmal_port_stats_fops);
+	}
+	for (idx = 0; idx < component->clocks; idx++) {
+		snprintf(dname, sizeof(dname), "clock%d", idx);
+		debugfs_create_file(dname, 0444, component->debugfs_dir,
+				    &component->clock[idx],
+				    &vchiq_mmal_port_stats_fops);
+	}
+}
+
 /* Initialise a mmal component and its ports
  *
  */
@@ -1878,35 +2247,33 @@ int vchiq_mmal_component_init(struct vchiq_mmal_instance *instance,
 {
 	int ret;
 	int idx;		/* port index */
-	struct vchiq_mmal_component *component = NULL;
-
-	if (mutex_lock_interruptible(&instance->vchiq_mutex))
-		return -EINTR;
+	struct vchiq_mmal_component *component;
 
-	for (idx = 0; idx < VCHIQ_MMAL_MAX_COMPONENTS; idx++) {
-		if (!instance->component[idx].in_use) {
-			component = &instance->component[idx];
-			component->in_use = 1;
-			break;
-		}
-	}
+	component = kzalloc(sizeof(*component), GFP_KERNEL);
+	if (!component)
+		return -ENOMEM;
 
-	if (!component) {
-		ret = -EINVAL;	/* todo is this correct error? */
-		goto unlock;
+	if (mutex_lock_interruptible(&instance->vchiq_mutex)) {
+		kfree(component);
+		return -EINTR;
 	}
 
 	/* We need a handle to reference back to our component structure.
-	 * Use the array index in instance->component rather than rolling
-	 * another IDR.
+	 * Use the index in instance->components.
 	 */
-	component->client_component = idx;
+	ret = xa_alloc(&instance->components, &component->client_component,
+		       component, xa_limit_32b, GFP_KERNEL);
+	if (ret)
+		goto unlock;
+
+	component->in_use = 1;
+	component->instance = instance;
 
 	ret = create_component(instance, component, name);
 	if (ret < 0) {
 		pr_err("%s: failed to create component %d (Not enough GPU mem?)\n",
 		       __func__, ret);
-		goto unlock;
+		goto erase_component;
 	}
 
 	/* ports info needs gathering */
@@ -1956,6 +2323,8 @@ int vchiq_mmal_component_init(struct vchiq_mmal_instance *instance,
 		init_event_context(instance, &component->clock[idx]);
 	}
 
+	component_debugfs_init(instance, component, name);
+
 	*component_out = component;
 
 	mutex_unlock(&instance->vchiq_mutex);
@@ -1965,10 +2334,11 @@ int vchiq_mmal_component_init(struct vchiq_mmal_instance *instance,
 release_component:
 	destroy_component(instance, component);
 	release_all_event_contexts(component);
+erase_component:
+	xa_erase(&instance->components, component->client_component);
 unlock:
-	if (component)
-		component->in_use = 0;
 	mutex_unlock(&instance->vchiq_mutex);
+	kfree(component);
 
 	return ret;
 }
@@ -1982,6 +2352,10 @@ int vchiq_mmal_component_finalise(struct vchiq_mmal_instance *instance,
 {
 	int ret;
 
+	/* readers take vchiq_mutex, so remove the files before locking */
+	debugfs_remove_recursive(component->debugfs_dir);
+	component->debugfs_dir = NULL;
+
 	if (mutex_lock_interruptible(&instance->vchiq_mutex))
 		return -EINTR;
 
@@ -1994,8 +2368,12 @@ int vchiq_mmal_component_finalise(struct vchiq_mmal_instance *instance,
 
 	release_all_event_contexts(component);
 
+	xa_erase(&instance->components, component->client_component);
+
 	mutex_unlock(&instance->vchiq_mutex);
 
+	kfree(component);
+
 	return ret;
 }
 EXPORT_SYMBOL_GPL(vchiq_mmal_component_finalise);
@@ -2068,6 +2446,32 @@ int vchiq_mmal_version(struct vchiq_mmal_instance *instance,
 }
 EXPORT_SYMBOL_GPL(vchiq_mmal_version);
 
+static int vchiq_mmal_port_info_stats_show(struct seq_file *s, void *v)
+{
+	struct vchiq_mmal_instance *instance = s->private;
+
+	seq_printf(s, "info_set_sent:    %u\n", instance->stats.info_set_sent);
+	seq_printf(s, "info_set_skipped: %u\n",
+		   instance->stats.info_set_skipped);
+	seq_printf(s, "info_get_sent:    %u\n", instance->stats.info_get_sent);
+	seq_printf(s, "info_get_skipped: %u\n",
+		   instance->stats.info_get_skipped);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vchiq_mmal_port_info_stats);
+
+static void vchiq_mmal_debugfs_init(struct vchiq_mmal_instance *instance)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "instance%d",
+		 atomic_inc_return(&mmal_instance_id) - 1);
+	instance->debugfs_dir = debugfs_create_dir(name, mmal_debugfs_root);
+	debugfs_create_file("port_info", 0444, instance->debugfs_dir,
+			    instance, &vchiq_mmal_port_info_stats_fops);
+}
+
 int vchiq_mmal_finalise(struct vchiq_mmal_instance *instance)
 {
 	int status = 0;
@@ -2075,6 +2479,9 @@ int vchiq_mmal_finalise(struct vchiq_mmal_instance *instance)
 	if (!instance)
 		return -EINVAL;
 
+	/* readers take vchiq_mutex, so remove the files before locking */
+	debugfs_remove_recursive(instance->debugfs_dir);
+
 	if (mutex_lock_interruptible(&instance->vchiq_mutex))
 		return -EINTR;
 
@@ -2093,6 +2500,10 @@ int vchiq_mmal_finalise(struct vchiq_mmal_instance *instance)
 
 	idr_destroy(&instance->context_map);
 
+	if (!xa_empty(&instance->components))
+		pr_warn("%s: components still allocated\n", __func__);
+	xa_destroy(&instance->components);
+
 	kfree(instance);
 
 	return status;
@@ -2150,6 +2561,8 @@ int vchiq_mmal_init(struct vchiq_mmal_instance **out_instance)
 	mutex_init(&instance->context_map_lock);
 	idr_init_base(&instance->context_map, 1);
 
+	xa_init_flags(&instance->components, XA_FLAGS_ALLOC);
+
 	params.callback_param = instance;
 
 	instance->bulk_wq = alloc_ordered_workqueue("mmal-vchiq",
@@ -2166,6 +2579,8 @@ int vchiq_mmal_init(struct vchiq_mmal_instance **out_instance)
 
 	vchi_service_release(instance->handle);
 
+	vchiq_mmal_debugfs_init(instance);
+
 	*out_instance = instance;
 
 	return 0;
@@ -2179,3 +2594,18 @@ err_free:
 	return -ENODEV;
 }
 EXPORT_SYMBOL_GPL(vchiq_mmal_init);
+
+static int __init vchiq_mmal_module_init(void)
+{
+	mmal_debugfs_root = debugfs_create_dir("mmal-vchiq", NULL);
+
+	return 0;
+}
+
+static void __exit vchiq_mmal_module_exit(void)
+{
+	debugfs_remove_recursive(mmal_debugfs_root);
+}
+
+module_init(vchiq_mmal_module_init);
+module_exit(vchiq_mmal_module_exit);
@@ -40,6 +40,20 @@ struct vchiq_mmal_port_buffer {
 	u32 alignment; /* alignment of buffers */
 };
 
+/* Writable port configuration as last read back from the VPU. Lets
+ * redundant PORT_INFO_SET/GET round trips be skipped.
+ */
+struct vchiq_mmal_port_shadow {
+	bool valid;
+	struct vchiq_mmal_port_buffer current_buffer;
+	u32 type;
+	u32 encoding;
+	u32 encoding_variant;
+	u32 bitrate;
+	u32 flags;
+	union mmal_es_specific_format es;
+};
+
 struct vchiq_mmal_port;
 
 typedef void (*vchiq_mmal_buffer_cb)(
@@ -68,6 +82,8 @@ struct vchiq_mmal_port {
 	struct mmal_es_format_local format;
 	/* elementary stream format */
 	union mmal_es_specific_format es;
+	/* last configuration committed to the VPU */
+	struct vchiq_mmal_port_shadow shadow;
 
 	/* data buffers to fill */
 	struct list_head buffers;
@@ -98,6 +114,8 @@ struct vchiq_mmal_component {
 	struct vchiq_mmal_port output[MAX_PORT_COUNT]; /* output ports */
 	struct vchiq_mmal_port clock[MAX_PORT_COUNT]; /* clock ports */
 	u32 client_component;	/* Used to ref back to client struct */
+	struct vchiq_mmal_instance *instance; /* instance owning component */
+	struct dentry *debugfs_dir;
 };
 
 int vchiq_mmal_init(struct vchiq_mmal_instance **out_instance);
@@ -159,6 +177,12 @@ int vchiq_mmal_port_connect_tunnel(struct vchiq_mmal_instance *instance,
 				   struct vchiq_mmal_port *src,
 				   struct vchiq_mmal_port *dst);
 
+/* retrieve the VPU side buffer statistics for one direction of a port */
+int vchiq_mmal_port_get_core_stats(struct vchiq_mmal_instance *instance,
+				   struct vchiq_mmal_port *port,
+				   enum mmal_core_stats_dir dir, bool reset,
+				   struct mmal_core_statistics *stats);
+
 int vchiq_mmal_version(struct vchiq_mmal_instance *instance,
 		       u32 *major_out,
 		       u32 *minor_out);
@@ -167,6 +191,11 @@ int vchiq_mmal_submit_buffer(struct vchiq_mmal_instance *instance,
 			     struct vchiq_mmal_port *port,
 			     struct mmal_buffer *buf);
 
+unsigned int vchiq_mmal_submit_buffers(struct vchiq_mmal_instance *instance,
+				       struct vchiq_mmal_port *port,
+				       struct mmal_buffer **buffers,
+				       unsigned int num_buffers);
+
 int mmal_vchi_buffer_unmap(struct mmal_buffer *buf);
 
 int mmal_vchi_buffer_init(struct vchiq_mmal_instance *instance,